@@ -0,0 +1,971 @@
+#include "Compiler.h"
+#include "Environment.h"
+#include "Resolver.h"
+#include "Runtime.h"
+#include "Types.h"
+
+#include <typeinfo>
+
+//  Compiled code builds a quasiquoted form from a template, which knows
+//  where the values of the forms unquoted in it go. Those forms are its
+//  holes: they're evaluated first, in order, and the template then makes
+//  the form around them in one go, without the lists that the cons and
+//  concat calls quasiquote expands to would make on the way.
+
+//  Returns the template for a resolved quasiquoted form, adding the forms
+//  unquoted in it to holes, or NULL if there are none and it's a constant.
+//  A form that is unquoted as a whole is up to the caller.
+malValuePtr makeTemplate(malValuePtr form, malValueVec& holes)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq) {
+        return NULL;
+    }
+    int before = holes.size();
+    malValuePtr tmpl(new malTemplate(seq, holes));
+    if ((int)holes.size() == before) {
+        return NULL;
+    }
+    return tmpl;
+}
+
+malTemplate::malTemplate(const malSequence* form, malValueVec& holes)
+: m_isVector(dynamic_cast<const malVector*>(form) != NULL)
+{
+    int base = holes.size();
+    for (auto it = form->begin(), end = form->end(); it != end; ++it) {
+        Part part = { Constant, (int)holes.size() - base, *it };
+        if (malValuePtr spliced = starts_with(*it, "splice-unquote")) {
+            part.kind = Splice;
+            holes.push_back(spliced);
+        }
+        else if (malValuePtr unquoted = starts_with(*it, "unquote")) {
+            part.kind = Hole;
+            holes.push_back(unquoted);
+        }
+        else if (malValuePtr nested = makeTemplate(*it, holes)) {
+            part.kind = Nested;
+            part.value = nested;
+        }
+        m_parts.push_back(part);
+    }
+}
+
+malValuePtr malTemplate::instantiate(malValueIter holes) const
+{
+    int count = 0;
+    for (auto& part : m_parts) {
+        count += part.kind == Splice ?
+            VALUE_CAST(malSequence, holes[part.hole])->count() : 1;
+    }
+
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    items->reserve(count);
+    for (auto& part : m_parts) {
+        switch (part.kind) {
+        case Constant:
+            items->push_back(part.value);
+            break;
+        case Hole:
+            items->push_back(holes[part.hole]);
+            break;
+        case Splice: {
+            const malSequence* seq =
+                STATIC_CAST(malSequence, holes[part.hole]);
+            items->insert(items->end(), seq->begin(), seq->end());
+            break;
+        }
+        case Nested:
+            items->push_back(STATIC_CAST(malTemplate, part.value)->
+                                 instantiate(holes + part.hole));
+            break;
+        }
+    }
+    return m_isVector ? mal::vector(items.release())
+                      : mal::list(items.release());
+}
+
+//  A value thrown by compiled code goes back to the try* that catches it as
+//  this marker, rather than as a C++ exception, which is costly to unwind.
+//  The value itself waits in s_thrown. Only compiled code sees the marker,
+//  and it's thrown as usual when it gets back to anything else.
+
+const malValuePtr s_thrownMarker(mal::symbol("#thrown"));
+malValuePtr s_thrown;
+
+//  Returns the builtin the global op names, or NULL.
+const malBuiltIn* globalBuiltin(malValuePtr op, malValuePtr& builtin)
+{
+    const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, op);
+    if (!sym || (sym->depth() >= 0)) {
+        return NULL;
+    }
+    builtin = replEnv->getOwn(sym->value());
+    return builtin ? DYNAMIC_CAST(malBuiltIn, builtin) : NULL;
+}
+
+//  Resolved code is compiled once more, into a tree of nodes which each know
+//  how to run one kind of form, so that running it needn't take the form
+//  apart again every time. Anything the compiler doesn't handle is left to
+//  EVAL.
+
+namespace {
+    class malNode;
+    typedef RefCountedPtr<malNode> malNodePtr;
+    typedef std::vector<malNodePtr> malNodeVec;
+
+    class malNode : public RefCounted {
+    public:
+        // Runs the node in env. A node in tail position may instead leave
+        // the node to run next in tail, with env set for it, and return NULL.
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const = 0;
+
+        // Runs the node and any tail calls it makes.
+        virtual malValuePtr eval(const malEnvPtr& env) const;
+
+        // Runs the node, returning true with the result in value if it's
+        // an integer, or else false with the result, or the thrown marker,
+        // in boxed. Sums of sums pass what's between them this way, so it
+        // needn't be boxed.
+        virtual bool evalInt(const malEnvPtr& env, int64_t& value,
+                             malValuePtr& boxed) const;
+    };
+
+    // A compiled body, as kept by the lambda it belongs to. It is compiled
+    // again with fast paths once it has been run s_hotRuns times.
+    class malCode : public malValue {
+    public:
+        malCode(malValuePtr ast);
+        malCode(const malCode& that, malValuePtr meta)
+            : malValue(meta), m_ast(that.m_ast), m_root(that.m_root)
+            , m_runs(that.m_runs) { }
+
+        virtual malValuePtr eval(malEnvPtr env) {
+            return rethrow(enter()->eval(env));
+        }
+
+        // Returns the node to run the body from, counting the run.
+        malNodePtr enter() const;
+
+        virtual String print(bool readably) const {
+            return STRF("#code(%p)", this);
+        }
+
+        virtual bool doIsEqualTo(const malValue* rhs) const {
+            return this == rhs;
+        }
+
+        WITH_META(malCode);
+
+    private:
+        const malValuePtr  m_ast;
+        mutable malNodePtr m_root;
+        mutable unsigned   m_runs;
+    };
+
+    class malConstantNode : public malNode {
+    public:
+        malConstantNode(malValuePtr value)
+            : m_value(value)
+            , m_isInteger(typeid(*value.ptr()) == typeid(malInteger))
+            , m_integer(m_isInteger ? STATIC_CAST(malInteger, value)->value()
+                                    : 0) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            return m_value;
+        }
+        virtual malValuePtr eval(const malEnvPtr& env) const {
+            return m_value;
+        }
+        virtual bool evalInt(const malEnvPtr& env, int64_t& value,
+                             malValuePtr& boxed) const {
+            value = m_integer;
+            if (!m_isInteger) {
+                boxed = m_value;
+            }
+            return m_isInteger;
+        }
+
+    private:
+        const malValuePtr m_value;
+        const bool        m_isInteger;
+        const int64_t     m_integer;
+    };
+
+    class malSymbolNode : public malNode {
+    public:
+        malSymbolNode(malValuePtr symbol) : m_symbol(symbol) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            return m_symbol->eval(env);
+        }
+        virtual malValuePtr eval(const malEnvPtr& env) const {
+            return m_symbol->eval(env);
+        }
+
+    private:
+        const malValuePtr m_symbol;
+    };
+
+    class malLocalNode : public malNode {
+    public:
+        malLocalNode(const malResolvedSymbol* symbol)
+            : m_name(symbol->value())
+            , m_depth(symbol->depth()), m_slot(symbol->slot()) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            return eval(env);
+        }
+        virtual malValuePtr eval(const malEnvPtr& env) const {
+            malEnv* frame = env->frame(m_depth);
+            if (malValuePtr local = frame->slot(m_slot)) {
+                return local;
+            }
+            return frame->outer()->get(m_name); // see malResolvedSymbol
+        }
+
+    private:
+        const String m_name;
+        const int    m_depth;
+        const int    m_slot;
+    };
+
+    class malEvalNode : public malNode {
+    public:
+        malEvalNode(malValuePtr ast) : m_ast(ast) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            return EVAL(m_ast, env);
+        }
+        virtual malValuePtr eval(const malEnvPtr& env) const {
+            return EVAL(m_ast, env);
+        }
+
+    private:
+        const malValuePtr m_ast;
+    };
+
+    class malDoNode : public malNode {
+    public:
+        malDoNode(const malNodeVec& body) : m_body(body) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            int last = m_body.size() - 1;
+            for (int i = 0; i < last; i++) {
+                malValuePtr value = m_body[i]->eval(env);
+                if (isThrown(value)) {
+                    return value;
+                }
+            }
+            return m_body[last]->exec(env, tail);
+        }
+
+    private:
+        const malNodeVec m_body;
+    };
+
+    class malIfNode : public malNode {
+    public:
+        malIfNode(malNodePtr test, malNodePtr then, malNodePtr otherwise)
+            : m_test(test), m_then(then), m_else(otherwise) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malValuePtr test = m_test->eval(env);
+            if (isThrown(test)) {
+                return test;
+            }
+            if (test->isTrue()) {
+                return m_then->exec(env, tail);
+            }
+            return m_else ? m_else->exec(env, tail) : mal::nilValue();
+        }
+
+    private:
+        const malNodePtr m_test;
+        const malNodePtr m_then;
+        const malNodePtr m_else;
+    };
+
+    // An and or an or, whose result is the first item that decides it.
+    class malAndOrNode : public malNode {
+    public:
+        malAndOrNode(bool isAnd, const malNodeVec& items)
+            : m_isAnd(isAnd), m_items(items) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            int last = m_items.size() - 1;
+            for (int i = 0; i < last; i++) {
+                malValuePtr value = m_items[i]->eval(env);
+                if (isThrown(value) || (value->isTrue() != m_isAnd)) {
+                    return value;
+                }
+            }
+            return m_items[last]->exec(env, tail);
+        }
+
+    private:
+        const bool       m_isAnd;
+        const malNodeVec m_items;
+    };
+
+    class malLetNode : public malNode {
+    public:
+        malLetNode(malEnvShapePtr shape, const malNodeVec& inits,
+                   malNodePtr body)
+            : m_shape(shape), m_inits(inits), m_body(body) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malEnvPtr inner(new malEnv(env, m_shape));
+            for (int i = 0, n = m_inits.size(); i < n; i++) {
+                malValuePtr value = m_inits[i]->eval(inner);
+                if (isThrown(value)) {
+                    return value;
+                }
+                inner->setSlot(m_shape->bindingSlot(i), value);
+            }
+            env = inner;
+            return m_body->exec(env, tail);
+        }
+
+    private:
+        const malEnvShapePtr m_shape;
+        const malNodeVec     m_inits;
+        const malNodePtr     m_body;
+    };
+
+    // A loop*, whose frame keeps the code of its body in its last slot for
+    // recur to go back to. The body is code of its own so that the nodes
+    // don't refer back to themselves.
+    class malLoopNode : public malNode {
+    public:
+        malLoopNode(malEnvShapePtr shape, const malNodeVec& inits,
+                    malValuePtr body)
+            : m_shape(shape), m_inits(inits), m_body(body) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malEnvPtr inner(new malEnv(env, m_shape));
+            int n = m_inits.size();
+            for (int i = 0; i < n; i++) {
+                malValuePtr value = m_inits[i]->eval(inner);
+                if (isThrown(value)) {
+                    return value;
+                }
+                inner->setSlot(m_shape->bindingSlot(i), value);
+            }
+            inner->setSlot(m_shape->bindingSlot(n), m_body);
+            env = inner;
+            tail = STATIC_CAST(malCode, m_body)->enter();
+            return NULL;
+        }
+
+    private:
+        const malEnvShapePtr m_shape;
+        const malNodeVec     m_inits;
+        const malValuePtr    m_body;
+    };
+
+    // A recur, depth frames in from its loop*. The loop's frame is bound
+    // again in place, unless a closure has kept it.
+    class malRecurNode : public malNode {
+    public:
+        malRecurNode(int depth, const malNodeVec& args)
+            : m_depth(depth), m_args(args) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            int n = m_args.size();
+            malSmallVec args(n);
+            for (int i = 0; i < n; i++) {
+                args[i] = m_args[i]->eval(env);
+                if (isThrown(args[i])) {
+                    return args[i];
+                }
+            }
+            env = env->frame(m_depth);
+            const malEnvShape* shape = env->shape();
+            malValuePtr body = env->slot(shape->bindingSlot(n));
+            if (env->refCount() != 1) {
+                env = env->emptyCopy();
+                env->setSlot(shape->bindingSlot(n), body);
+            }
+            for (int i = 0; i < n; i++) {
+                env->setSlot(shape->bindingSlot(i), args[i]);
+            }
+            tail = STATIC_CAST(malCode, body)->enter();
+            return NULL;
+        }
+
+    private:
+        const int        m_depth;
+        const malNodeVec m_args;
+    };
+
+    class malFnNode : public malNode {
+    public:
+        malFnNode(malEnvShapePtr shape, malValuePtr sourceBody,
+                  malValuePtr code, unsigned epoch)
+            : m_shape(shape), m_sourceBody(sourceBody), m_code(code)
+            , m_epoch(epoch) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malValuePtr lambda = mal::lambda(m_shape, m_sourceBody, env);
+            STATIC_CAST(malLambda, lambda)->setResolvedBody(m_code, m_epoch);
+            return lambda;
+        }
+
+    private:
+        const malEnvShapePtr m_shape;
+        const malValuePtr    m_sourceBody;
+        const malValuePtr    m_code;
+        const unsigned       m_epoch;
+    };
+
+    // A fn* of several clauses, each made by a malFnNode.
+    class malClausesNode : public malNode {
+    public:
+        malClausesNode(const malNodeVec& clauses) : m_clauses(clauses) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malValueVec clauses;
+            for (auto& clause : m_clauses) {
+                clauses.push_back(clause->eval(env));
+            }
+            return mal::lambda(clauses);
+        }
+
+    private:
+        const malNodeVec m_clauses;
+    };
+
+    class malTryNode : public malNode {
+    public:
+        malTryNode(malNodePtr body, malEnvShapePtr shape, malNodePtr handler)
+            : m_body(body), m_shape(shape), m_handler(handler) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            if (!m_handler) {
+                return m_body->exec(env, tail);
+            }
+            malValuePtr excVal;
+            try {
+                malValuePtr value = m_body->eval(env);
+                if (!isThrown(value)) {
+                    return value;
+                }
+                excVal = takeThrown();
+            }
+            catch(String& s) {
+                excVal = mal::string(s);
+            }
+            catch (malEmptyInputException&) {
+                return mal::nilValue();
+            }
+            catch(malValuePtr& o) {
+                excVal = o;
+            };
+            env = malEnvPtr(new malEnv(env, m_shape, &excVal, &excVal + 1));
+            return m_handler->exec(env, tail);
+        }
+
+    private:
+        const malNodePtr     m_body;
+        const malEnvShapePtr m_shape;
+        const malNodePtr     m_handler;
+    };
+
+    class malCallNode : public malNode {
+    public:
+        malCallNode(malNodePtr op, const malNodeVec& args)
+            : m_op(op), m_args(args) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malValuePtr op = m_op->eval(env);
+            if (isThrown(op)) {
+                return op;
+            }
+            malSmallVec args(m_args.size());
+            for (int i = 0; i < args.size(); i++) {
+                args[i] = m_args[i]->eval(env);
+                if (isThrown(args[i])) {
+                    return args[i];
+                }
+            }
+            return call(op, args.begin(), args.end(), env, tail);
+        }
+
+    protected:
+        static malValuePtr call(malValuePtr op, malValueIter argsBegin,
+                                malValueIter argsEnd,
+                                malEnvPtr& env, malNodePtr& tail) {
+            const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+            if (!lambda && dispatch(op, argsBegin, argsEnd)) {
+                lambda = DYNAMIC_CAST(malLambda, op);
+            }
+            if (lambda) {
+                lambda = lambda->clause(argsEnd - argsBegin);
+                malValuePtr body = lambdaBody(lambda);
+                lambda->rebindEnv(env, argsBegin, argsEnd);
+                if (const malCode* code = DYNAMIC_CAST(malCode, body)) {
+                    tail = code->enter();
+                    return NULL; // TCO
+                }
+                return EVAL(body, env);
+            }
+            return APPLY(op, argsBegin, argsEnd);
+        }
+
+        const malNodePtr m_op;
+        const malNodeVec m_args;
+    };
+
+    // A call in hot code of one of the integer builtins. While the global
+    // still names that builtin and both arguments are integers, it does the
+    // sum itself, and otherwise makes the call as usual. An argument that
+    // is itself such a sum hands over its result unboxed.
+    class malIntOpNode : public malCallNode {
+    public:
+        malIntOpNode(malIntOp::Kind intOp, malValuePtr builtin,
+                     malNodePtr op, const malNodeVec& args)
+            : malCallNode(op, args), m_intOp(intOp), m_builtin(builtin) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malValuePtr op, args[2];
+            int64_t ints[2];
+            if (!evalOperands(env, op, args, ints)) {
+                return malIntOp::compute(m_intOp, ints[0], ints[1]);
+            }
+            if (isThrown(args[0])) {
+                return args[0];
+            }
+            return call(op, args, args + 2, env, tail);
+        }
+
+        virtual bool evalInt(const malEnvPtr& env, int64_t& value,
+                             malValuePtr& boxed) const {
+            if (m_intOp > malIntOp::Multiply) {
+                return malNode::evalInt(env, value, boxed);
+            }
+            malValuePtr op, args[2];
+            int64_t ints[2];
+            if (!evalOperands(env, op, args, ints)) {
+                value = malIntOp::arithmetic(m_intOp, ints[0], ints[1]);
+                return true;
+            }
+            if (isThrown(args[0])) {
+                boxed = args[0];
+                return false;
+            }
+            boxed = APPLY(op, args, args + 2);
+            if (typeid(*boxed.ptr()) != typeid(malInteger)) {
+                return false;
+            }
+            value = STATIC_CAST(malInteger, boxed)->value();
+            return true;
+        }
+
+    private:
+        // Evaluates op and the arguments. Returns false with the integers in
+        // ints if the sum can be done in place, or else true with op and the
+        // boxed arguments to call it with, or the thrown marker in args[0].
+        bool evalOperands(const malEnvPtr& env, malValuePtr& op,
+                          malValuePtr* args, int64_t* ints) const {
+            op = m_op->eval(env);
+            if (isThrown(op)) {
+                args[0] = op;
+                return true;
+            }
+            bool areInts = true;
+            for (int i = 0; i < 2; i++) {
+                if (!m_args[i]->evalInt(env, ints[i], args[i])) {
+                    if (isThrown(args[i])) {
+                        args[0] = args[i];
+                        return true;
+                    }
+                    areInts = false;
+                }
+            }
+            if (areInts && (op == m_builtin)) {
+                return false;
+            }
+            for (int i = 0; i < 2; i++) {
+                if (!args[i]) {
+                    args[i] = mal::integer(ints[i]);
+                }
+            }
+            return true;
+        }
+
+        const malIntOp::Kind m_intOp;
+        const malValuePtr    m_builtin;
+    };
+
+    // A call of the throw builtin, which hands the value to the try* that
+    // catches it as the thrown marker, while the global still names it.
+    class malThrowNode : public malCallNode {
+    public:
+        malThrowNode(malValuePtr builtin, malNodePtr op, const malNodeVec& args)
+            : malCallNode(op, args), m_builtin(builtin) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malValuePtr op = m_op->eval(env);
+            if (isThrown(op)) {
+                return op;
+            }
+            malValuePtr value = m_args[0]->eval(env);
+            if (isThrown(value)) {
+                return value;
+            }
+            if (op != m_builtin) {
+                return call(op, &value, &value + 1, env, tail);
+            }
+            return throwValue(value);
+        }
+
+    private:
+        const malValuePtr m_builtin;
+    };
+
+    class malVectorNode : public malNode {
+    public:
+        malVectorNode(const malNodeVec& items) : m_items(items) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malSmallVec items(m_items.size());
+            for (int i = 0; i < items.size(); i++) {
+                items[i] = m_items[i]->eval(env);
+                if (isThrown(items[i])) {
+                    return items[i];
+                }
+            }
+            return mal::vector(items.begin(), items.end());
+        }
+
+    private:
+        const malNodeVec m_items;
+    };
+
+    class malHashNode : public malNode {
+    public:
+        malHashNode(const malValueVec& keys, const malNodeVec& values)
+            : m_keys(keys), m_values(values) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malSmallVec items(2 * m_keys.size());
+            for (int i = 0, n = m_keys.size(); i < n; i++) {
+                items[2 * i] = m_keys[i];
+                items[2 * i + 1] = m_values[i]->eval(env);
+                if (isThrown(items[2 * i + 1])) {
+                    return items[2 * i + 1];
+                }
+            }
+            return mal::hash(items.begin(), items.end(), true);
+        }
+
+    private:
+        const malValueVec m_keys;
+        const malNodeVec  m_values;
+    };
+
+    class malTemplateNode : public malNode {
+    public:
+        malTemplateNode(malValuePtr tmpl, const malNodeVec& holes)
+            : m_template(tmpl), m_holes(holes) { }
+
+        virtual malValuePtr exec(malEnvPtr& env, malNodePtr& tail) const {
+            malSmallVec holes(m_holes.size());
+            for (int i = 0; i < holes.size(); i++) {
+                holes[i] = m_holes[i]->eval(env);
+                if (isThrown(holes[i])) {
+                    return holes[i];
+                }
+            }
+            return STATIC_CAST(malTemplate, m_template)->
+                       instantiate(holes.begin());
+        }
+
+    private:
+        const malValuePtr m_template;
+        const malNodeVec  m_holes;
+    };
+
+    bool malNode::evalInt(const malEnvPtr& env, int64_t& value,
+                          malValuePtr& boxed) const
+    {
+        boxed = eval(env);
+        if (typeid(*boxed.ptr()) != typeid(malInteger)) {
+            return false;
+        }
+        value = STATIC_CAST(malInteger, boxed)->value();
+        return true;
+    }
+
+    malValuePtr malNode::eval(const malEnvPtr& env) const
+    {
+        checkStack();
+        malEnvPtr frame = env;
+        malNodePtr tail;
+        malValuePtr value = exec(frame, tail);
+        while (!value) {
+            malNodePtr node = tail;
+            value = node->exec(frame, tail);
+        }
+        return value;
+    }
+}
+
+static malNodePtr compile(malValuePtr ast, bool isHot);
+
+//  Finds the builtin a global names, if it is one malIntOpNode can do.
+bool findIntOp(malValuePtr op, malValuePtr& builtin, malIntOp::Kind& intOp)
+{
+    static const struct {
+        const char*    name;
+        malIntOp::Kind intOp;
+    } intOps[] = {
+        { "+",  malIntOp::Add },
+        { "-",  malIntOp::Subtract },
+        { "*",  malIntOp::Multiply },
+        { "=",  malIntOp::Equal },
+        { "<",  malIntOp::Less },
+        { "<=", malIntOp::LessEqual },
+        { ">",  malIntOp::Greater },
+        { ">=", malIntOp::GreaterEqual },
+    };
+
+    const malBuiltIn* fn = globalBuiltin(op, builtin);
+    if (!fn) {
+        return false;
+    }
+    for (auto& entry : intOps) {
+        if (fn->name() == entry.name) {
+            intOp = entry.intOp;
+            return true;
+        }
+    }
+    return false;
+}
+
+//  Says whether the global op names the throw builtin, and returns it.
+bool isThrowBuiltin(malValuePtr op, malValuePtr& builtin)
+{
+    const malBuiltIn* fn = globalBuiltin(op, builtin);
+    return fn && (fn->name() == "throw");
+}
+
+static malNodeVec compileItems(const malSequence* seq, int from, bool isHot)
+{
+    malNodeVec nodes;
+    for (int i = from; i < seq->count(); i++) {
+        nodes.push_back(compile(seq->item(i), isHot));
+    }
+    return nodes;
+}
+
+static malNodePtr compileSpecial(malValuePtr ast, const malSymbol* special,
+                                 bool isHot)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    int argCount = list->count() - 1;
+
+    switch (special->specialForm()) {
+    case malSymbol::Do:
+        if (argCount >= 1) {
+            return new malDoNode(compileItems(list, 1, isHot));
+        }
+        break;
+
+    case malSymbol::If:
+        if ((argCount == 2) || (argCount == 3)) {
+            return new malIfNode(compile(list->item(1), isHot),
+                                 compile(list->item(2), isHot),
+                                 argCount == 3 ?
+                                     compile(list->item(3), isHot) :
+                                     malNodePtr());
+        }
+        break;
+
+    case malSymbol::And:
+    case malSymbol::Or:
+        if (argCount >= 1) {
+            return new malAndOrNode(special->specialForm() == malSymbol::And,
+                                    compileItems(list, 1, isHot));
+        }
+        break;
+
+    case malSymbol::Quote:
+        if (argCount == 1) {
+            return new malConstantNode(list->item(1));
+        }
+        break;
+
+    case malSymbol::Quasiquote:
+        if (argCount == 1) {
+            malValuePtr form = list->item(1);
+            if (malValuePtr unquoted = starts_with(form, "unquote")) {
+                return compile(unquoted, isHot);
+            }
+            malValueVec holes;
+            malValuePtr tmpl = makeTemplate(form, holes);
+            if (!tmpl) {
+                return new malConstantNode(form);
+            }
+            malNodeVec nodes;
+            for (auto& hole : holes) {
+                nodes.push_back(compile(hole, isHot));
+            }
+            return new malTemplateNode(tmpl, nodes);
+        }
+        break;
+
+    case malSymbol::Fn:
+        if (const malBinder* binder = DYNAMIC_CAST(malBinder, list->item(0))) {
+            malValuePtr code(new malCode(list->item(2)));
+            return new malFnNode(binder->shape(), binder->sourceBody(),
+                                 code, binder->epoch());
+        }
+        if (DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            return new malClausesNode(compileItems(list, 1, isHot));
+        }
+        break;
+
+    case malSymbol::Let:
+        if (const malBinder* binder = DYNAMIC_CAST(malBinder, list->item(0))) {
+            const malSequence* bindings =
+                STATIC_CAST(malSequence, list->item(1));
+            malNodeVec inits;
+            for (int i = 1; i < bindings->count(); i += 2) {
+                inits.push_back(compile(bindings->item(i), isHot));
+            }
+            return new malLetNode(binder->shape(), inits,
+                                  compile(list->item(2), isHot));
+        }
+        break;
+
+    case malSymbol::Loop:
+        if (const malBinder* binder = DYNAMIC_CAST(malBinder, list->item(0))) {
+            const malSequence* bindings =
+                STATIC_CAST(malSequence, list->item(1));
+            malNodeVec inits;
+            for (int i = 1; i < bindings->count(); i += 2) {
+                inits.push_back(compile(bindings->item(i), isHot));
+            }
+            return new malLoopNode(binder->shape(), inits,
+                                   new malCode(list->item(2)));
+        }
+        break;
+
+    case malSymbol::Recur:
+        if (const malResolvedSymbol* sym =
+                DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            return new malRecurNode(sym->depth(),
+                                    compileItems(list, 1, isHot));
+        }
+        break;
+
+    case malSymbol::Try:
+        if (argCount == 1) {
+            return new malTryNode(compile(list->item(1), isHot),
+                                  NULL, NULL);
+        }
+        if (argCount == 2) {
+            const malList* handler = STATIC_CAST(malList, list->item(2));
+            const malBinder* binder =
+                STATIC_CAST(malBinder, handler->item(0));
+            return new malTryNode(compile(list->item(1), isHot),
+                                  binder->shape(),
+                                  compile(handler->item(2), isHot));
+        }
+        break;
+
+    default:
+        break;
+    }
+    // Leave EVAL to report the error, or to expand the macro.
+    return new malEvalNode(ast);
+}
+
+//  Compiles a form that has been through the resolver, with fast paths if
+//  it is hot.
+static malNodePtr compile(malValuePtr ast, bool isHot)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, ast)) {
+        if (sym->depth() >= 0) {
+            return new malLocalNode(sym);
+        }
+        return new malSymbolNode(ast);
+    }
+
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        return new malVectorNode(compileItems(vec, 0, isHot));
+    }
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (hash->isEvaluated()) {
+            return new malConstantNode(ast);
+        }
+        malValuePtr keyList = hash->keys();
+        const malSequence* keys = STATIC_CAST(malSequence, keyList);
+        malValueVec keyVec;
+        malNodeVec values;
+        for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+            keyVec.push_back(*it);
+            values.push_back(compile(hash->get(*it), isHot));
+        }
+        return new malHashNode(keyVec, values);
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        if (DYNAMIC_CAST(malSymbol, ast)) {
+            return new malEvalNode(ast);
+        }
+        return new malConstantNode(ast);
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        if (!DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            return new malEvalNode(ast); // left as written by the resolver
+        }
+        if (sym->specialForm() != malSymbol::NotSpecial) {
+            return compileSpecial(ast, sym, isHot);
+        }
+    }
+
+    malNodePtr op = compile(list->item(0), isHot);
+    malNodeVec args = compileItems(list, 1, isHot);
+    malValuePtr builtin;
+    malIntOp::Kind intOp;
+    if (isHot && (args.size() == 2) &&
+        findIntOp(list->item(0), builtin, intOp)) {
+        return new malIntOpNode(intOp, builtin, op, args);
+    }
+    if ((args.size() == 1) && isThrowBuiltin(list->item(0), builtin)) {
+        return new malThrowNode(builtin, op, args);
+    }
+    return new malCallNode(op, args);
+}
+
+malCode::malCode(malValuePtr ast)
+: m_ast(ast)
+, m_root(compile(ast, false))
+, m_runs(0)
+{
+
+}
+
+malNodePtr malCode::enter() const
+{
+    if ((m_runs < s_hotRuns) && (++m_runs == s_hotRuns)) {
+        m_root = compile(m_ast, true);
+    }
+    return m_root;
+}
+
+malValuePtr compileCode(malValuePtr ast)
+{
+    return new malCode(ast);
+}
+
+bool isCode(malValuePtr value)
+{
+    return DYNAMIC_CAST(malCode, value) != NULL;
+}
@@ -0,0 +1,130 @@
+#ifndef INCLUDE_COMPILER_H
+#define INCLUDE_COMPILER_H
+
+#include "MAL.h"
+#include "Types.h"
+
+#include <cstdint>
+#include <typeinfo>
+
+// The form a quasiquoted form in compiled code is built from, which knows
+// where the values of the forms unquoted in it, its holes, go.
+class malTemplate : public malValue {
+public:
+    // Adds the forms unquoted in form, and in the forms inside it, to holes.
+    malTemplate(const malSequence* form, malValueVec& holes);
+    malTemplate(const malTemplate& that, malValuePtr meta)
+        : malValue(meta), m_parts(that.m_parts)
+        , m_isVector(that.m_isVector) { }
+
+    // Makes the form, given the values of its holes.
+    malValuePtr instantiate(malValueIter holes) const;
+
+    virtual String print(bool readably) const {
+        return STRF("#template(%p)", this);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malTemplate);
+
+private:
+    enum Kind { Constant, Hole, Splice, Nested };
+
+    // Hole and Splice parts take the value of hole; a Nested part is the
+    // template in value, whose holes start at hole. Each counts from the
+    // first hole of this template.
+    struct Part {
+        Kind        kind;
+        int         hole;
+        malValuePtr value;
+    };
+
+    std::vector<Part> m_parts;
+    const bool        m_isVector;
+};
+
+extern malValuePtr makeTemplate(malValuePtr form, malValueVec& holes);
+
+// A value thrown by compiled code goes back to the try* that catches it as
+// this marker, with the value itself in s_thrown, see Compiler.cpp.
+extern const malValuePtr s_thrownMarker;
+extern malValuePtr s_thrown;
+
+inline bool isThrown(const malValuePtr& value)
+{
+    return value == s_thrownMarker;
+}
+
+inline malValuePtr throwValue(malValuePtr value)
+{
+    s_thrown = value;
+    return s_thrownMarker;
+}
+
+inline malValuePtr takeThrown()
+{
+    malValuePtr value = s_thrown;
+    s_thrown = NULL;
+    return value;
+}
+
+//  Returns value, or throws what it stands for if it's the marker.
+inline malValuePtr rethrow(malValuePtr value)
+{
+    if (isThrown(value)) {
+        throw takeThrown();
+    }
+    return value;
+}
+
+// The integer builtins that compiled code does itself, while the global
+// still names the builtin and the arguments are integers.
+struct malIntOp {
+    enum Kind {
+        Add, Subtract, Multiply,
+        Equal, Less, LessEqual, Greater, GreaterEqual,
+    };
+
+    // Whether both of two arguments are integers. Comparing the type is
+    // cheaper than a cast.
+    static bool areIntegers(const malValuePtr* args) {
+        return (typeid(*args[0].ptr()) == typeid(malInteger)) &&
+               (typeid(*args[1].ptr()) == typeid(malInteger));
+    }
+
+    // The result of kind on two integers.
+    static malValuePtr compute(Kind kind, int64_t a, int64_t b) {
+        switch (kind) {
+            case Equal:         return mal::boolean(a == b);
+            case Less:          return mal::boolean(a < b);
+            case LessEqual:     return mal::boolean(a <= b);
+            case Greater:       return mal::boolean(a > b);
+            case GreaterEqual:  return mal::boolean(a >= b);
+            default:            return mal::integer(arithmetic(kind, a, b));
+        }
+    }
+
+    // The result of Add, Subtract or Multiply on two integers.
+    static int64_t arithmetic(Kind kind, int64_t a, int64_t b) {
+        switch (kind) {
+            case Add:           return a + b;
+            case Subtract:      return a - b;
+            default:            return a * b;
+        }
+    }
+};
+
+extern const malBuiltIn* globalBuiltin(malValuePtr op, malValuePtr& builtin);
+extern bool findIntOp(malValuePtr op,
+                      malValuePtr& builtin, malIntOp::Kind& intOp);
+extern bool isThrowBuiltin(malValuePtr op, malValuePtr& builtin);
+
+// Compiles resolved code to a tree of nodes, returning the body for a lambda
+// to run, see malCode.
+extern malValuePtr compileCode(malValuePtr ast);
+extern bool isCode(malValuePtr value);
+
+#endif // INCLUDE_COMPILER_H
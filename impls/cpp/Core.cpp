@@ -28,29 +28,30 @@ static StaticList<malBuiltIn*> handlers;
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
-#define BUILTIN_DEF(uniq, symbol) \
+#define BUILTIN_DEF(uniq, symbol, isPure) \
     static malBuiltIn::ApplyFunc FUNCNAME(uniq); \
     static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
-        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq))); \
+        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq), isPure)); \
     malValuePtr FUNCNAME(uniq)(const String& name, \
         malValueIter argsBegin, malValueIter argsEnd)
 
-#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
+#define BUILTIN(symbol)       BUILTIN_DEF(__LINE__, symbol, false)
+#define BUILTIN_PURE(symbol)  BUILTIN_DEF(__LINE__, symbol, true)
 
 #define BUILTIN_ISA(symbol, type) \
-    BUILTIN(symbol) { \
+    BUILTIN_PURE(symbol) { \
         CHECK_ARGS_IS(1); \
         return mal::boolean(DYNAMIC_CAST(type, *argsBegin)); \
     }
 
 #define BUILTIN_IS(op, constant) \
-    BUILTIN(op) { \
+    BUILTIN_PURE(op) { \
         CHECK_ARGS_IS(1); \
         return mal::boolean(*argsBegin == mal::constant()); \
     }
 
 #define BUILTIN_INTOP(op, checkDivByZero) \
-    BUILTIN(#op) { \
+    BUILTIN_PURE(#op) { \
         CHECK_ARGS_IS(2); \
         ARG(malInteger, lhs); \
         ARG(malInteger, rhs); \
@@ -79,7 +80,7 @@ BUILTIN_IS("true?",         trueValue);
 BUILTIN_IS("false?",        falseValue);
 BUILTIN_IS("nil?",          nilValue);
 
-BUILTIN("-")
+BUILTIN_PURE("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
     ARG(malInteger, lhs);
@@ -91,7 +92,7 @@ BUILTIN("-")
     return mal::integer(lhs->value() - rhs->value());
 }
 
-BUILTIN("<=")
+BUILTIN_PURE("<=")
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -100,7 +101,7 @@ BUILTIN("<=")
     return mal::boolean(lhs->value() <= rhs->value());
 }
 
-BUILTIN(">=")
+BUILTIN_PURE(">=")
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -109,7 +110,7 @@ BUILTIN(">=")
     return mal::boolean(lhs->value() >= rhs->value());
 }
 
-BUILTIN("<")
+BUILTIN_PURE("<")
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -118,7 +119,7 @@ BUILTIN("<")
     return mal::boolean(lhs->value() < rhs->value());
 }
 
-BUILTIN(">")
+BUILTIN_PURE(">")
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -127,7 +128,7 @@ BUILTIN(">")
     return mal::boolean(lhs->value() > rhs->value());
 }
 
-BUILTIN("=")
+BUILTIN_PURE("=")
 {
     CHECK_ARGS_IS(2);
     const malValue* lhs = (*argsBegin++).ptr();
@@ -136,28 +137,37 @@ BUILTIN("=")
     return mal::boolean(lhs->isEqualTo(rhs));
 }
 
+BUILTIN("add-method")
+{
+    CHECK_ARGS_IS(3);
+    ARG(malMultiMethod, multi);
+    malValuePtr value = *argsBegin++;
+    multi->addMethod(value, *argsBegin);
+    return malValuePtr(multi);
+}
+
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
-
-    // Then append the argument as a list.
+    // Copy the first N-1 arguments in, then the items of the last one.
     const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
-    }
+    malSmallVec args((argsEnd - 1 - argsBegin) + lastArg->count());
+    std::copy(lastArg->begin(), lastArg->end(),
+              std::copy(argsBegin, argsEnd-1, args.begin()));
 
     return APPLY(op, args.begin(), args.end());
 }
 
-BUILTIN("assoc")
+BUILTIN_PURE("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
     ARG(malHash, hash);
 
+    if (hash->isUnique()) {
+        return hash->assocInPlace(argsBegin, argsEnd);
+    }
     return hash->assoc(argsBegin, argsEnd);
 }
 
@@ -168,7 +178,7 @@ BUILTIN("atom")
     return mal::atom(*argsBegin);
 }
 
-BUILTIN("concat")
+BUILTIN_PURE("concat")
 {
     int count = 0;
     for (auto it = argsBegin; it != argsEnd; ++it) {
@@ -176,6 +186,21 @@ BUILTIN("concat")
         count += seq->count();
     }
 
+    // Append to the first list if nobody else can see it.
+    malList* list = (argsBegin != argsEnd) ? DYNAMIC_CAST(malList, *argsBegin)
+                                           : NULL;
+    if (list && list->isUnique()) {
+        malValueVec items;
+        items.reserve(count - list->count());
+        for (auto it = argsBegin + 1; it != argsEnd; ++it) {
+            const malSequence* seq = STATIC_CAST(malSequence, *it);
+            items.insert(items.end(), seq->begin(), seq->end());
+        }
+        if (list->appendInPlace(items.data(), items.data() + items.size())) {
+            return list;
+        }
+    }
+
     malValueVec* items = new malValueVec(count);
     int offset = 0;
     for (auto it = argsBegin; it != argsEnd; ++it) {
@@ -187,15 +212,20 @@ BUILTIN("concat")
     return mal::list(items);
 }
 
-BUILTIN("conj")
+BUILTIN_PURE("conj")
 {
     CHECK_ARGS_AT_LEAST(1);
     ARG(malSequence, seq);
 
+    // Vectors grow at the end, so nobody else holding it makes it cheap.
+    if (dynamic_cast<malVector*>(seq) && seq->isUnique() &&
+        seq->appendInPlace(argsBegin, argsEnd)) {
+        return seq;
+    }
     return seq->conj(argsBegin, argsEnd);
 }
 
-BUILTIN("cons")
+BUILTIN_PURE("cons")
 {
     CHECK_ARGS_IS(2);
     malValuePtr first = *argsBegin++;
@@ -208,7 +238,7 @@ BUILTIN("cons")
     return mal::list(items);
 }
 
-BUILTIN("contains?")
+BUILTIN_PURE("contains?")
 {
     CHECK_ARGS_IS(2);
     if (*argsBegin == mal::nilValue()) {
@@ -218,7 +248,7 @@ BUILTIN("contains?")
     return mal::boolean(hash->contains(*argsBegin));
 }
 
-BUILTIN("count")
+BUILTIN_PURE("count")
 {
     CHECK_ARGS_IS(1);
     if (*argsBegin == mal::nilValue()) {
@@ -237,15 +267,18 @@ BUILTIN("deref")
     return atom->deref();
 }
 
-BUILTIN("dissoc")
+BUILTIN_PURE("dissoc")
 {
     CHECK_ARGS_AT_LEAST(1);
     ARG(malHash, hash);
 
+    if (hash->isUnique()) {
+        return hash->dissocInPlace(argsBegin, argsEnd);
+    }
     return hash->dissoc(argsBegin, argsEnd);
 }
 
-BUILTIN("empty?")
+BUILTIN_PURE("empty?")
 {
     CHECK_ARGS_IS(1);
     ARG(malSequence, seq);
@@ -259,7 +292,29 @@ BUILTIN("eval")
     return EVAL(*argsBegin, NULL);
 }
 
-BUILTIN("first")
+BUILTIN("extend")
+{
+    CHECK_ARGS_AT_LEAST(3);
+    ARG(malKeyword, type);
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+              "extend expects a map of methods for each protocol");
+
+    int typeId = malProtocol::typeNamed(type->value());
+    while (argsBegin != argsEnd) {
+        ARG(malProtocol, protocol);
+        ARG(malHash, methods);
+        protocol->extend(typeId, methods);
+    }
+    return mal::nilValue();
+}
+
+BUILTIN_PURE("find-type")
+{
+    CHECK_ARGS_IS(1);
+    return malProtocol::typeName(malProtocol::typeOf(argsBegin->ptr()));
+}
+
+BUILTIN_PURE("first")
 {
     CHECK_ARGS_IS(1);
     if (*argsBegin == mal::nilValue()) {
@@ -269,7 +324,7 @@ BUILTIN("first")
     return seq->first();
 }
 
-BUILTIN("fn?")
+BUILTIN_PURE("fn?")
 {
     CHECK_ARGS_IS(1);
     malValuePtr arg = *argsBegin++;
@@ -278,11 +333,19 @@ BUILTIN("fn?")
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, arg)) {
         return mal::boolean(!lambda->isMacro());
     }
-    // Builtins are functions.
-    return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
+    // Builtins, protocol methods and multimethods are functions.
+    return mal::boolean(DYNAMIC_CAST(malApplicable, arg));
+}
+
+BUILTIN("get-method")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malMultiMethod, multi);
+    malValuePtr method = multi->methodForValue(*argsBegin);
+    return method ? method : mal::nilValue();
 }
 
-BUILTIN("get")
+BUILTIN_PURE("get")
 {
     CHECK_ARGS_IS(2);
     if (*argsBegin == mal::nilValue()) {
@@ -292,19 +355,25 @@ BUILTIN("get")
     return hash->get(*argsBegin);
 }
 
-BUILTIN("hash-map")
+BUILTIN_PURE("hash-map")
 {
     return mal::hash(argsBegin, argsEnd, true);
 }
 
-BUILTIN("keys")
+BUILTIN_PURE("intern-value")
+{
+    CHECK_ARGS_IS(1);
+    return mal::intern(*argsBegin);
+}
+
+BUILTIN_PURE("keys")
 {
     CHECK_ARGS_IS(1);
     ARG(malHash, hash);
     return hash->keys();
 }
 
-BUILTIN("keyword")
+BUILTIN_PURE("keyword")
 {
     CHECK_ARGS_IS(1);
     const malValuePtr arg = *argsBegin++;
@@ -315,12 +384,12 @@ BUILTIN("keyword")
     MAL_FAIL("keyword expects a keyword or string");
 }
 
-BUILTIN("list")
+BUILTIN_PURE("list")
 {
     return mal::list(argsBegin, argsEnd);
 }
 
-BUILTIN("macro?")
+BUILTIN_PURE("macro?")
 {
     CHECK_ARGS_IS(1);
 
@@ -345,7 +414,7 @@ BUILTIN("map")
     return  mal::list(items);
 }
 
-BUILTIN("meta")
+BUILTIN_PURE("meta")
 {
     CHECK_ARGS_IS(1);
     malValuePtr obj = *argsBegin++;
@@ -353,7 +422,14 @@ BUILTIN("meta")
     return obj->meta();
 }
 
-BUILTIN("nth")
+BUILTIN("multimethod")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malString, id);
+    return mal::multiMethod(id->value(), *argsBegin);
+}
+
+BUILTIN_PURE("nth")
 {
     CHECK_ARGS_IS(2);
     ARG(malSequence, seq);
@@ -365,7 +441,7 @@ BUILTIN("nth")
     return seq->item(i);
 }
 
-BUILTIN("pr-str")
+BUILTIN_PURE("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
 }
@@ -398,6 +474,14 @@ BUILTIN("readline")
     return readline(str->value());
 }
 
+BUILTIN("remove-method")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malMultiMethod, multi);
+    multi->removeMethod(*argsBegin);
+    return malValuePtr(multi);
+}
+
 BUILTIN("reset!")
 {
     CHECK_ARGS_IS(2);
@@ -405,7 +489,7 @@ BUILTIN("reset!")
     return atom->reset(*argsBegin);
 }
 
-BUILTIN("rest")
+BUILTIN_PURE("rest")
 {
     CHECK_ARGS_IS(1);
     if (*argsBegin == mal::nilValue()) {
@@ -415,7 +499,15 @@ BUILTIN("rest")
     return seq->rest();
 }
 
-BUILTIN("seq")
+BUILTIN("satisfies?")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malProtocol, protocol);
+    int type = malProtocol::typeOf(argsBegin->ptr());
+    return mal::boolean(protocol->isExtendedBy(type));
+}
+
+BUILTIN_PURE("seq")
 {
     CHECK_ARGS_IS(1);
     malValuePtr arg = *argsBegin++;
@@ -461,7 +553,7 @@ BUILTIN("slurp")
     return mal::string(data);
 }
 
-BUILTIN("str")
+BUILTIN_PURE("str")
 {
     return mal::string(printValues(argsBegin, argsEnd, "", false));
 }
@@ -473,15 +565,31 @@ BUILTIN("swap!")
 
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    malValueVec args(1 + argsEnd - argsBegin);
+    malSmallVec args(1 + argsEnd - argsBegin);
     args[0] = atom->deref();
     std::copy(argsBegin, argsEnd, args.begin() + 1);
 
+    // A pure builtin can't look at the atom, so it can be given the only
+    // reference to the old value and update it in place. Nothing is changed
+    // in place before all the arguments have been checked, so the old
+    // value is still intact if it throws.
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op);
+    if (builtin && builtin->isPure()) {
+        atom->reset(mal::nilValue());
+        try {
+            return atom->reset(APPLY(op, args.begin(), args.end()));
+        }
+        catch (...) {
+            atom->reset(args[0]);
+            throw;
+        }
+    }
+
     malValuePtr value = APPLY(op, args.begin(), args.end());
     return atom->reset(value);
 }
 
-BUILTIN("symbol")
+BUILTIN_PURE("symbol")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, token);
@@ -506,26 +614,26 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
-BUILTIN("vals")
+BUILTIN_PURE("vals")
 {
     CHECK_ARGS_IS(1);
     ARG(malHash, hash);
     return hash->values();
 }
 
-BUILTIN("vec")
+BUILTIN_PURE("vec")
 {
     CHECK_ARGS_IS(1);
     ARG(malSequence, s);
     return mal::vector(s->begin(), s->end());
 }
 
-BUILTIN("vector")
+BUILTIN_PURE("vector")
 {
     return mal::vector(argsBegin, argsEnd);
 }
 
-BUILTIN("with-meta")
+BUILTIN_PURE("with-meta")
 {
     CHECK_ARGS_IS(2);
     malValuePtr obj  = *argsBegin++;
@@ -0,0 +1,698 @@
+#include "Emitter.h"
+#include "Compiler.h"
+#include "Environment.h"
+#include "Resolver.h"
+#include "Runtime.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+//  --emit-cpp file.mal prints a C++ program that does what running the file
+//  does. First the file's def!, defmacro! and load-file forms are run, so
+//  that macros are expanded just as they would be when it's run. Each def!
+//  of a function is then turned into a C++ function where its body allows,
+//  with its locals as C++ locals, integer sums done in place, and tail calls
+//  to itself as loops. Everything else is kept as source, for the program
+//  to evaluate as it goes.
+
+namespace {
+    // Thrown for a form that can't be turned into C++, which leaves the def!
+    // it's in to be evaluated from source.
+    class Unemittable { };
+
+    class malCppEmitter {
+    public:
+        malCppEmitter(const String& filename)
+            : m_filename(filename), m_functionCount(0) { }
+
+        // Adds the next top level form of the file.
+        void addForm(malValuePtr form);
+
+        String program() const;
+
+    private:
+        bool emitFunction(const String& name, malValuePtr fn);
+
+        String value(malValuePtr ast);
+        void tail(malValuePtr ast);
+        String special(const malList* list, const malSymbol* special,
+                       bool isTail);
+        String call(const malList* list, bool isTail);
+
+        String constant(malValuePtr value);
+        String global(const String& name);
+        String temp(const String& expr);
+        String local();
+        String argRange(const StringVec& args);
+        void line(const String& text);
+
+        // The whole program.
+        String           m_filename;
+        StringVec        m_constants;
+        StringVec        m_globals;
+        StringVec        m_intOps;
+        std::map<String, int> m_functions; // compiled so far, by mal name
+        int              m_functionCount;
+        String           m_definitions;
+        String           m_run;
+
+        // The function being emitted. Each frame the resolver gave it holds
+        // the C++ local of each slot, innermost last, and whether it's set.
+        struct Frame {
+            StringVec         vars;
+            std::vector<bool> isSet;
+        };
+        std::vector<Frame> m_frames;
+        String             m_code;
+        String             m_indent;
+        int                m_temps;
+        StringVec          m_locals;
+        String             m_self;
+        StringVec          m_params; // C++ locals, if calls to self can loop
+        bool               m_isLooping;
+    };
+}
+
+//  Returns text as a C++ string literal.
+static String cppLiteral(const String& text)
+{
+    String out = "\"";
+    for (auto it = text.begin(), end = text.end(); it != end; ++it) {
+        switch (*it) {
+            case '\\': out += "\\\\"; break;
+            case '"':  out += "\\\""; break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            case '?':  out += "\\?";  break; // no trigraphs
+            default:   out += *it;    break;
+        }
+    }
+    return out + "\"";
+}
+
+void malCppEmitter::addForm(malValuePtr form)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    const malSymbol* head = list && !list->isEmpty() ?
+        DYNAMIC_CAST(malSymbol, list->item(0)) : NULL;
+    const malSymbol* id = head && (list->count() == 3) ?
+        DYNAMIC_CAST(malSymbol, list->item(1)) : NULL;
+
+    if (id && (head->specialForm() == malSymbol::Def) &&
+        emitFunction(id->value(), list->item(2))) {
+        EVAL(form, replEnv);
+        int index = m_functions[id->value()];
+        m_run += STRF("    c_%d = mal::builtin(%s, w_%d);\n"
+                      "    EVAL(mal::list(mal::symbol(\"def!\"), "
+                      "mal::symbol(%s), c_%d), env);\n",
+                      index, cppLiteral(id->value()).c_str(), index,
+                      cppLiteral(id->value()).c_str(), index);
+        return;
+    }
+
+    if (head && ((head->specialForm() == malSymbol::Def) ||
+                 (head->specialForm() == malSymbol::DefMacro) ||
+                 (head->value() == "load-file"))) {
+        EVAL(form, replEnv);
+    }
+    m_run += STRF("    EVAL(readStr(%s), env);\n",
+                  cppLiteral(form->print(true)).c_str());
+}
+
+bool malCppEmitter::emitFunction(const String& name, malValuePtr fn)
+{
+    const malList* list = DYNAMIC_CAST(malList, fn);
+    const malSymbol* head = list && (list->count() == 3) ?
+        DYNAMIC_CAST(malSymbol, list->item(0)) : NULL;
+    const malSequence* params = head ?
+        DYNAMIC_CAST(malSequence, list->item(1)) : NULL;
+    StringVec names;
+    if (!params || (head->specialForm() != malSymbol::Fn) ||
+        !symbolNames(params, 1, names)) {
+        return false;
+    }
+    auto amp = std::find(names.begin(), names.end(), "&");
+    bool hasRest = amp != names.end();
+    if (hasRest && (amp != names.end() - 2)) {
+        return false; // leave the error to the interpreter
+    }
+
+    int index = m_functionCount;
+    std::map<String, int> functions = m_functions;
+    m_functions[name] = index;
+
+    m_frames.clear();
+    m_code.clear();
+    m_indent = "    ";
+    m_temps = 0;
+    m_locals.clear();
+    m_self = name;
+    m_params.clear();
+    m_isLooping = false;
+
+    try {
+        malEnvShapePtr shape(new malEnvShape(names, true));
+        Scope scope = { shape.ptr(), NULL };
+        malValuePtr body = resolve(list->item(2), &scope, replEnv.ptr());
+
+        Frame frame;
+        for (int i = 0; i < shape->slotCount(); i++) {
+            frame.vars.push_back(local());
+            frame.isSet.push_back(true);
+        }
+        m_frames.push_back(frame);
+
+        int bindings = names.size() - (hasRest ? 1 : 0);
+        int fixed = bindings - (hasRest ? 1 : 0);
+        String binding;
+        if (fixed > 0) {
+            binding += STRF("    MAL_CHECK(argsEnd - argsBegin >= %d, "
+                            "\"Not enough parameters\");\n", fixed);
+        }
+        if (!hasRest) {
+            binding += STRF("    MAL_CHECK(argsEnd - argsBegin <= %d, "
+                            "\"Too many parameters\");\n", fixed);
+        }
+        for (int i = 0; i < fixed; i++) {
+            String var = frame.vars[shape->bindingSlot(i)];
+            binding += STRF("    %s = argsBegin[%d];\n", var.c_str(), i);
+            m_params.push_back(var);
+        }
+        if (hasRest) {
+            String var = frame.vars[shape->bindingSlot(fixed)];
+            binding += STRF("    %s = mal::list(argsBegin + %d, argsEnd);\n",
+                            var.c_str(), fixed);
+            m_params.clear();
+        }
+
+        tail(body);
+
+        String decls;
+        for (auto& var : m_locals) {
+            decls += "    malValuePtr " + var + ";\n";
+        }
+        m_definitions += STRF(
+            "// %s\n"
+            "static malValuePtr f_%d(malValueIter argsBegin, "
+            "malValueIter argsEnd)\n"
+            "{\n    checkStack();\n%s%s%s%s}\n\n"
+            "static malValuePtr w_%d(const String& name,\n"
+            "                        malValueIter argsBegin, "
+            "malValueIter argsEnd)\n"
+            "{\n    return f_%d(argsBegin, argsEnd);\n}\n\n",
+            name.c_str(), index, decls.c_str(), binding.c_str(),
+            m_isLooping ? "start:\n" : "", m_code.c_str(), index, index);
+        m_functionCount++;
+        return true;
+    }
+    catch (Unresolvable&) {
+    }
+    catch (Unemittable&) {
+    }
+    m_functions = functions;
+    return false;
+}
+
+//  Emits code to work out ast, and returns the C++ local holding it.
+String malCppEmitter::value(malValuePtr ast)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, ast)) {
+        if (sym->depth() < 0) {
+            return temp(global(sym->value()) + "->eval(s_env)");
+        }
+        Frame& frame = m_frames[m_frames.size() - 1 - sym->depth()];
+        if (!frame.isSet[sym->slot()]) {
+            throw Unemittable(); // a let* binding that isn't made yet
+        }
+        return frame.vars[sym->slot()];
+    }
+
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        StringVec items;
+        for (auto it = vec->begin(), end = vec->end(); it != end; ++it) {
+            items.push_back(value(*it));
+        }
+        String list;
+        for (auto& item : items) {
+            list += (list.empty() ? "" : ", ") + item;
+        }
+        return temp("mal::vector(new malValueVec{" + list + "})");
+    }
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (!hash->isEvaluated()) {
+            malValuePtr keyList = hash->keys();
+            const malSequence* keys = STATIC_CAST(malSequence, keyList);
+            String list;
+            for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+                String key = constant(*it);
+                list += (list.empty() ? "" : ", ") + key + ", " +
+                        value(hash->get(*it));
+            }
+            String items = STRF("a%d", m_temps++);
+            line("malValueVec " + items + "{" + list + "};");
+            return temp(STRF("mal::hash(%s.data(), %s.data() + %s.size(), "
+                             "true)", items.c_str(), items.c_str(),
+                             items.c_str()));
+        }
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        if (DYNAMIC_CAST(malSymbol, ast)) {
+            throw Unemittable();
+        }
+        return constant(ast);
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        if (!DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            throw Unemittable(); // left as written by the resolver
+        }
+        if (sym->specialForm() != malSymbol::NotSpecial) {
+            return special(list, sym, false);
+        }
+    }
+    return call(list, false);
+}
+
+//  Emits code to return ast.
+void malCppEmitter::tail(malValuePtr ast)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    const malResolvedSymbol* sym = list && !list->isEmpty() ?
+        DYNAMIC_CAST(malResolvedSymbol, list->item(0)) : NULL;
+    if (sym && (sym->specialForm() != malSymbol::NotSpecial)) {
+        special(list, sym, true);
+    }
+    else if (sym) {
+        call(list, true);
+    }
+    else {
+        line("return " + value(ast) + ";");
+    }
+}
+
+String malCppEmitter::special(const malList* list, const malSymbol* special,
+                              bool isTail)
+{
+    int argCount = list->count() - 1;
+
+    switch (special->specialForm()) {
+    case malSymbol::Do:
+        if (argCount >= 1) {
+            for (int i = 1; i < argCount; i++) {
+                value(list->item(i));
+            }
+            if (isTail) {
+                tail(list->item(argCount));
+                return String();
+            }
+            return value(list->item(argCount));
+        }
+        break;
+
+    case malSymbol::If:
+        if ((argCount == 2) || (argCount == 3)) {
+            String test = value(list->item(1));
+            malValuePtr otherwise = argCount == 3 ?
+                list->item(3) : mal::nilValue();
+            String result;
+            if (!isTail) {
+                result = local();
+            }
+            std::vector<Frame> frames = m_frames;
+            String indent = m_indent;
+            line("if (" + test + "->isTrue()) {");
+            m_indent += "    ";
+            if (isTail) {
+                tail(list->item(2));
+            }
+            else {
+                line(result + " = " + value(list->item(2)) + ";");
+            }
+            m_indent = indent;
+            m_frames = frames;
+            if (isTail) {
+                line("}");
+                tail(otherwise);
+                return String();
+            }
+            line("}");
+            line("else {");
+            m_indent += "    ";
+            line(result + " = " + value(otherwise) + ";");
+            m_indent = indent;
+            m_frames = frames;
+            line("}");
+            return result;
+        }
+        break;
+
+    case malSymbol::And:
+    case malSymbol::Or:
+        if (argCount >= 1) {
+            // Each item is only worked out if those before didn't decide.
+            bool isAnd = special->specialForm() == malSymbol::And;
+            String result = local();
+            std::vector<Frame> frames = m_frames;
+            for (int i = 1; i <= argCount; i++) {
+                line(result + " = " + value(list->item(i)) + ";");
+                if (i < argCount) {
+                    line(STRF("if (%s%s->isTrue()) {", isAnd ? "" : "!",
+                              result.c_str()));
+                    m_indent += "    ";
+                }
+            }
+            for (int i = 1; i < argCount; i++) {
+                m_indent.resize(m_indent.size() - 4);
+                line("}");
+            }
+            m_frames = frames;
+            if (isTail) {
+                line("return " + result + ";");
+            }
+            return result;
+        }
+        break;
+
+    case malSymbol::Quote:
+        if (argCount == 1) {
+            String result = constant(list->item(1));
+            if (isTail) {
+                line("return " + result + ";");
+            }
+            return result;
+        }
+        break;
+
+    case malSymbol::Quasiquote:
+        if (argCount == 1) {
+            // As the calls to cons and concat it expands to.
+            malValuePtr expansion = quasiquote(list->item(1), true);
+            if (isTail) {
+                tail(expansion);
+                return String();
+            }
+            return value(expansion);
+        }
+        break;
+
+    case malSymbol::Let:
+        if (const malBinder* binder = DYNAMIC_CAST(malBinder, list->item(0))) {
+            const malEnvShapePtr& shape = binder->shape();
+            Frame frame;
+            for (int i = 0; i < shape->slotCount(); i++) {
+                frame.vars.push_back(local());
+                frame.isSet.push_back(false);
+            }
+            m_frames.push_back(frame);
+            const malSequence* bindings =
+                STATIC_CAST(malSequence, list->item(1));
+            for (int i = 1; i < bindings->count(); i += 2) {
+                String init = value(bindings->item(i));
+                int slot = shape->bindingSlot(i / 2);
+                line(m_frames.back().vars[slot] + " = " + init + ";");
+                m_frames.back().isSet[slot] = true;
+            }
+            String result;
+            if (isTail) {
+                tail(list->item(2));
+            }
+            else {
+                result = value(list->item(2));
+            }
+            m_frames.pop_back();
+            return result;
+        }
+        break;
+
+    case malSymbol::Try:
+        if (argCount == 1) {
+            if (isTail) {
+                tail(list->item(1));
+                return String();
+            }
+            return value(list->item(1));
+        }
+        if (argCount == 2) {
+            const malList* handler = STATIC_CAST(malList, list->item(2));
+            String result = local();
+            String exc = local();
+            String indent = m_indent;
+            line(exc + " = NULL;");
+            line("try {");
+            m_indent += "    ";
+            line(result + " = " + value(list->item(1)) + ";");
+            m_indent = indent;
+            line("}");
+            line("catch (String& s) {");
+            line("    " + exc + " = mal::string(s);");
+            line("}");
+            line("catch (malEmptyInputException&) {");
+            line("    " + result + " = mal::nilValue();");
+            line("}");
+            line("catch (malValuePtr& o) {");
+            line("    " + exc + " = o;");
+            line("}");
+            line("if (" + exc + ") {");
+            m_indent += "    ";
+            Frame frame;
+            frame.vars.push_back(exc);
+            frame.isSet.push_back(true);
+            m_frames.push_back(frame);
+            line(result + " = " + value(handler->item(2)) + ";");
+            m_frames.pop_back();
+            m_indent = indent;
+            line("}");
+            if (isTail) {
+                line("return " + result + ";");
+            }
+            return result;
+        }
+        break;
+
+    default:
+        break;
+    }
+    throw Unemittable();
+}
+
+String malCppEmitter::call(const malList* list, bool isTail)
+{
+    String op = value(list->item(0));
+    StringVec args;
+    for (int i = 1; i < list->count(); i++) {
+        args.push_back(value(list->item(i)));
+    }
+
+    const malResolvedSymbol* sym =
+        DYNAMIC_CAST(malResolvedSymbol, list->item(0));
+    String name = sym && (sym->depth() < 0) ? sym->value() : String();
+
+    malValuePtr builtin;
+    malIntOp::Kind intOp;
+    String expr;
+    if ((args.size() == 2) && findIntOp(list->item(0), builtin, intOp)) {
+        auto it = std::find(m_intOps.begin(), m_intOps.end(), name);
+        int index = it - m_intOps.begin();
+        if (it == m_intOps.end()) {
+            m_intOps.push_back(name);
+        }
+        expr = STRF("intOp<%d>(%s, b_%d, %s, %s)", intOp, op.c_str(), index,
+                    args[0].c_str(), args[1].c_str());
+    }
+    else if (m_functions.count(name)) {
+        int index = m_functions[name];
+        String range = argRange(args);
+        if (isTail && (name == m_self) && (args.size() == m_params.size()) &&
+            !m_params.empty()) {
+            line(STRF("if (%s == c_%d) {", op.c_str(), index));
+            for (int i = 0, n = args.size(); i < n; i++) {
+                line("    " + m_params[i] + " = " + args[i] + ";");
+            }
+            line("    goto start;");
+            line("}");
+            m_isLooping = true;
+            line("return APPLY(" + op + ", " + range + ");");
+            return String();
+        }
+        expr = STRF("%s == c_%d ? f_%d(%s) : APPLY(%s, %s)", op.c_str(),
+                    index, index, range.c_str(), op.c_str(), range.c_str());
+    }
+    else {
+        expr = "APPLY(" + op + ", " + argRange(args) + ")";
+    }
+
+    if (isTail) {
+        line("return " + expr + ";");
+        return String();
+    }
+    return temp(expr);
+}
+
+String malCppEmitter::constant(malValuePtr value)
+{
+    // Only values that read back as themselves can be written as source.
+    String text = value->print(true);
+    malValuePtr copy;
+    try {
+        copy = readStr(text);
+    }
+    catch (String&) {
+        throw Unemittable();
+    }
+    catch (malEmptyInputException&) {
+        throw Unemittable();
+    }
+    if (!copy->isEqualTo(value.ptr()) ||
+        (copy->print(true) != text)) {
+        throw Unemittable();
+    }
+    m_constants.push_back(text);
+    return STRF("k_%d", (int)m_constants.size() - 1);
+}
+
+String malCppEmitter::global(const String& name)
+{
+    auto it = std::find(m_globals.begin(), m_globals.end(), name);
+    if (it == m_globals.end()) {
+        m_globals.push_back(name);
+        it = m_globals.end() - 1;
+    }
+    return STRF("g_%d", (int)(it - m_globals.begin()));
+}
+
+String malCppEmitter::temp(const String& expr)
+{
+    String var = STRF("t%d", m_temps++);
+    line("malValuePtr " + var + " = " + expr + ";");
+    return var;
+}
+
+String malCppEmitter::local()
+{
+    m_locals.push_back(STRF("l%d", (int)m_locals.size()));
+    return m_locals.back();
+}
+
+String malCppEmitter::argRange(const StringVec& args)
+{
+    if (args.empty()) {
+        return "NULL, NULL";
+    }
+    String list;
+    for (auto& arg : args) {
+        list += (list.empty() ? "" : ", ") + arg;
+    }
+    String array = STRF("a%d", m_temps++);
+    line("malValuePtr " + array + "[] = { " + list + " };");
+    return STRF("%s, %s + %d", array.c_str(), array.c_str(),
+                (int)args.size());
+}
+
+void malCppEmitter::line(const String& text)
+{
+    m_code += m_indent + text + "\n";
+}
+
+String malCppEmitter::program() const
+{
+    String out = STRF("// Compiled from %s by stepA_mal --emit-cpp.\n\n",
+                      m_filename.c_str());
+    out += "#include \"MAL.h\"\n"
+           "#include \"Environment.h\"\n"
+           "#include \"Runtime.h\"\n"
+           "#include \"Types.h\"\n\n"
+           "static malEnvPtr s_env;\n\n"
+           "// A call of one of the integer builtins, done in place while\n"
+           "// op is still that builtin and both arguments are integers.\n"
+           "template<int kind>\n"
+           "static malValuePtr intOp(malValuePtr op, "
+           "const malValuePtr& builtin,\n"
+           "                         malValuePtr lhs, malValuePtr rhs)\n"
+           "{\n"
+           "    const malInteger* a = DYNAMIC_CAST(malInteger, lhs);\n"
+           "    const malInteger* b = DYNAMIC_CAST(malInteger, rhs);\n"
+           "    if ((op != builtin) || !a || !b) {\n"
+           "        malValuePtr args[] = { lhs, rhs };\n"
+           "        return APPLY(op, args, args + 2);\n"
+           "    }\n"
+           "    switch (kind) {\n";
+    static const char* intOps[] = {
+        "integer(a->value() + b->value())",
+        "integer(a->value() - b->value())",
+        "integer(a->value() * b->value())",
+        "boolean(a->value() == b->value())",
+        "boolean(a->value() < b->value())",
+        "boolean(a->value() <= b->value())",
+        "boolean(a->value() > b->value())",
+        "boolean(a->value() >= b->value())",
+    };
+    for (int i = 0; i < 8; i++) {
+        out += STRF("        case %d: return mal::%s;\n", i, intOps[i]);
+    }
+    out += "    }\n"
+           "    return NULL;\n"
+           "}\n\n";
+
+    for (int i = 0, n = m_constants.size(); i < n; i++) {
+        out += STRF("static malValuePtr k_%d;\n", i);
+    }
+    for (int i = 0, n = m_globals.size(); i < n; i++) {
+        out += STRF("static malValuePtr g_%d(new malResolvedSymbol(%s));\n",
+                    i, cppLiteral(m_globals[i]).c_str());
+    }
+    for (int i = 0, n = m_intOps.size(); i < n; i++) {
+        out += STRF("static malValuePtr b_%d;\n", i);
+    }
+    for (int i = 0; i < m_functionCount; i++) {
+        out += STRF("static malValuePtr c_%d;\n", i);
+    }
+    out += "\n" + m_definitions;
+
+    out += "static void run(malEnvPtr env)\n"
+           "{\n"
+           "    s_env = env;\n";
+    for (int i = 0, n = m_constants.size(); i < n; i++) {
+        out += STRF("    k_%d = readStr(%s);\n",
+                    i, cppLiteral(m_constants[i]).c_str());
+    }
+    for (int i = 0, n = m_intOps.size(); i < n; i++) {
+        out += STRF("    b_%d = env->get(%s);\n",
+                    i, cppLiteral(m_intOps[i]).c_str());
+    }
+    out += m_run;
+    out += "}\n\n"
+           "// Has stepA_mal's main run the program in place of the REPL.\n"
+           "static const bool s_isSet = setCompiledProgram(run);\n";
+    return out;
+}
+
+//  Prints the C++ program for the mal program in filename.
+int emitCpp(const String& filename)
+{
+    s_inlineCalls = false;
+    try {
+        malValuePtr source = EVAL(readStr(STRF(
+            "(read-string (str \"(do \" (slurp %s) \"\\nnil)\"))",
+            escape(filename).c_str())), replEnv);
+        const malList* forms = VALUE_CAST(malList, source);
+        malCppEmitter emitter(filename);
+        for (int i = 1; i < forms->count() - 1; i++) {
+            emitter.addForm(forms->item(i));
+        }
+        std::cout << emitter.program();
+        return 0;
+    }
+    catch (malValuePtr& mv) {
+        std::cerr << "Error: " << mv->print(true) << "\n";
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+    }
+    return 1;
+}
@@ -0,0 +1,10 @@
+#ifndef INCLUDE_EMITTER_H
+#define INCLUDE_EMITTER_H
+
+#include "MAL.h"
+
+// Prints the C++ program for the mal program in filename, for --emit-cpp.
+// Returns the exit status.
+extern int emitCpp(const String& filename);
+
+#endif // INCLUDE_EMITTER_H
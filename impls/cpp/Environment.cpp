@@ -3,42 +3,127 @@
 
 #include <algorithm>
 
+unsigned malEnv::s_resolveEpoch = 0;
+unsigned malEnv::s_globalEpoch = 0;
+
+malEnvShape::malEnvShape(const StringVec& bindings, bool isParams)
+: m_hasRest(false)
+, m_isBadRest(false)
+{
+    int n = bindings.size();
+    for (int i = 0; i < n; i++) {
+        if (isParams && (bindings[i] == "&")) {
+            m_hasRest = true;
+            m_isBadRest = m_isBadRest || (i != n - 2);
+            continue;
+        }
+        int slot = slotOf(bindings[i]);
+        if (slot < 0) {
+            slot = m_names.size();
+            m_names.push_back(bindings[i]);
+        }
+        m_bindingSlots.push_back(slot);
+    }
+}
+
+int malEnvShape::slotOf(const String& name) const
+{
+    for (int i = 0, n = m_names.size(); i < n; i++) {
+        if (m_names[i] == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 malEnv::malEnv(malEnvPtr outer)
 : m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
+malEnv::malEnv(malEnvPtr outer, malEnvShapePtr shape)
+: m_outer(outer)
+, m_shape(shape)
+, m_slots(shape->slotCount())
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+}
+
+malEnv::malEnv(malEnvPtr outer, malEnvShapePtr shape,
                malValueIter argsBegin, malValueIter argsEnd)
 : m_outer(outer)
+, m_shape(shape)
+, m_slots(shape->slotCount())
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
-    int n = bindings.size();
-    auto it = argsBegin;
-    for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
-            MAL_CHECK(i == n - 2, "There must be one parameter after the &");
+    bind(argsBegin, argsEnd);
+}
 
-            set(bindings[n-1], mal::list(it, argsEnd));
-            return;
-        }
+malEnv::~malEnv()
+{
+    TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+}
+
+void malEnv::rebind(malEnvPtr outer, malEnvShapePtr shape,
+                    malValueIter argsBegin, malValueIter argsEnd)
+{
+    // Only for frames nobody else can see, such as the one a tail call is
+    // leaving. Every slot of a parameter shape gets bound, so the old
+    // values only need clearing when the shape changes.
+    ASSERT(refCount() == 1, "Rebinding a shared malEnv %p\n", this);
+    TRACE_ENV("Rebinding malEnv %p, outer=%p\n", this, outer.ptr());
+    if (m_shape != shape) {
+        m_slots.clear();
+        m_slots.resize(shape->slotCount());
+        m_shape = shape;
+    }
+    if (!m_map.empty()) {
+        m_map.clear();
+    }
+    m_outer = outer;
+    bind(argsBegin, argsEnd);
+}
+
+void malEnv::bind(malValueIter argsBegin, malValueIter argsEnd)
+{
+    const malEnvShape& shape = *m_shape.ptr();
+    MAL_CHECK(!shape.m_isBadRest, "There must be one parameter after the &");
+
+    int fixed = shape.m_bindingSlots.size() - (shape.m_hasRest ? 1 : 0);
+    auto it = argsBegin;
+    for (int i = 0; i < fixed; i++) {
         MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
+        m_slots[shape.m_bindingSlots[i]] = *it;
         ++it;
     }
+    if (shape.m_hasRest) {
+        m_slots[shape.m_bindingSlots[fixed]] = mal::list(it, argsEnd);
+        return;
+    }
     MAL_CHECK(it == argsEnd, "Too many parameters");
 }
 
-malEnv::~malEnv()
+malValuePtr malEnv::getOwn(const String& symbol) const
 {
-    TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+    if (m_shape) {
+        // An empty slot is a let* binding that hasn't been made yet.
+        int slot = m_shape->slotOf(symbol);
+        if (slot >= 0) {
+            return m_slots[slot];
+        }
+    }
+    if (m_map.empty()) {
+        return NULL;
+    }
+    auto it = m_map.find(symbol);
+    return it != m_map.end() ? it->second->value() : malValuePtr();
 }
 
 malEnvPtr malEnv::find(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (env->getOwn(symbol)) {
             return env;
         }
     }
@@ -47,18 +132,55 @@ malEnvPtr malEnv::find(const String& symbol)
 
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (malValuePtr value = env->getOwn(symbol)) {
+            return value;
         }
     }
     MAL_FAIL("'%s' not found", symbol.c_str());
 }
 
+malValuePtr malEnv::get(const String& symbol, malVarCellPtr& globalCell)
+{
+    malEnv* env = this;
+    for (; env->m_outer; env = env->m_outer.ptr()) {
+        if (malValuePtr value = env->getOwn(symbol)) {
+            return value;
+        }
+    }
+    auto it = env->m_map.find(symbol);
+    MAL_CHECK(it != env->m_map.end(), "'%s' not found", symbol.c_str());
+    globalCell = it->second;
+    return globalCell->value();
+}
+
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
+    if (m_shape) {
+        int slot = m_shape->slotOf(symbol);
+        if (slot >= 0) {
+            m_slots[slot] = value;
+            return value;
+        }
+    }
+    auto it = m_map.find(symbol);
+    if (it != m_map.end()) {
+        it->second->set(value);
+        return value;
+    }
+    if (m_outer) {
+        // A new name in a local frame hides any global or local of the same
+        // name further out, which resolved code would otherwise still use.
+        s_globalEpoch++;
+        for (malEnv* env = m_outer.ptr(); env->m_outer;
+             env = env->m_outer.ptr()) {
+            if (env->m_shape && (env->m_shape->slotOf(symbol) >= 0)) {
+                invalidateResolved();
+                break;
+            }
+        }
+    }
+    m_map.insert(std::make_pair(symbol, malVarCellPtr(new malVarCell(value))));
     return value;
 }
 
@@ -5,25 +5,104 @@
 
 #include <map>
 
+// The layout of a frame made by fn*, let* or catch*: the names of its slots,
+// and the slot each of the form's bindings goes into. A name that is bound
+// more than once gets a single slot.
+class malEnvShape : public RefCounted {
+public:
+    malEnvShape(const StringVec& bindings, bool isParams);
+
+    int slotCount() const { return m_names.size(); }
+    int slotOf(const String& name) const;
+    int bindingSlot(int binding) const { return m_bindingSlots[binding]; }
+
+    // For fn* params, how many there are before any & rest.
+    int fixedCount() const { return m_bindingSlots.size() - m_hasRest; }
+    bool hasRest() const { return m_hasRest; }
+
+private:
+    friend class malEnv;
+
+    StringVec        m_names;
+    std::vector<int> m_bindingSlots;
+    bool             m_hasRest;     // fn* params with & rest
+    bool             m_isBadRest;   // & isn't followed by exactly one name
+};
+
+// A binding in a frame's map. Cells in the global environment stay put once
+// made, so resolved code can cache the ones it looks up.
+class malVarCell : public RefCounted {
+public:
+    malVarCell(malValuePtr value) : m_value(value) { }
+
+    malValuePtr value() const { return m_value; }
+    void set(malValuePtr value) { m_value = value; }
+
+private:
+    malValuePtr m_value;
+};
+
 class malEnv : public RefCounted {
 public:
     malEnv(malEnvPtr outer = NULL);
+    malEnv(malEnvPtr outer, malEnvShapePtr shape);
     malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+           malEnvShapePtr shape,
            malValueIter argsBegin,
            malValueIter argsEnd);
 
     ~malEnv();
 
+    void rebind(malEnvPtr outer,
+                malEnvShapePtr shape,
+                malValueIter argsBegin,
+                malValueIter argsEnd);
+
     malValuePtr get(const String& symbol);
+    malValuePtr get(const String& symbol, malVarCellPtr& globalCell);
+    malValuePtr getOwn(const String& symbol) const;
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
     malEnvPtr   getRoot();
 
+    // Direct access for resolved code, which knows where its locals are.
+    malEnv* frame(int depth) {
+        malEnv* env = this;
+        while (depth-- > 0) {
+            env = env->m_outer.ptr();
+        }
+        return env;
+    }
+    malValuePtr slot(int index) const { return m_slots[index]; }
+    void setSlot(int index, malValuePtr value) { m_slots[index] = value; }
+
+    malEnvPtr outer() const { return m_outer; }
+    const malEnvShape* shape() const { return m_shape.ptr(); }
+
+    // An empty frame of the same shape, to bind again in place of this one
+    // when a closure has kept it.
+    malEnvPtr emptyCopy() const { return new malEnv(m_outer, m_shape); }
+
+    // Bumped whenever code resolved earlier may have gone out of date, such
+    // as when a macro is defined or a def! shadows a resolved local.
+    static unsigned resolveEpoch() { return s_resolveEpoch; }
+    static void invalidateResolved() { s_resolveEpoch++; }
+
+    // Bumped when a def! in a local frame could hide a global that has
+    // been cached.
+    static unsigned globalEpoch() { return s_globalEpoch; }
+
 private:
-    typedef std::map<String, malValuePtr> Map;
+    void bind(malValueIter argsBegin, malValueIter argsEnd);
+
+    typedef std::map<String, malVarCellPtr> Map;
     Map m_map;
     malEnvPtr m_outer;
+    malEnvShapePtr m_shape;
+    malValueVec m_slots;
+
+    static unsigned s_resolveEpoch;
+    static unsigned s_globalEpoch;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -0,0 +1,338 @@
+#include "Fold.h"
+#include "Environment.h"
+#include "Resolver.h"
+#include "Types.h"
+
+//  Resolved code is folded before it is compiled. Calls of pure builtins
+//  whose arguments are all constants are made there and then, an if whose
+//  test is a constant loses the branch that can't be taken, and locals bound
+//  to constants by let* are replaced by their values. A def! of a name bound
+//  to a pure builtin has resolved code made again, see EVAL.
+
+//  Says whether value is data that can be put in code as a constant, with
+//  nothing in it that can change, like an atom, or be called.
+static bool isFoldable(malValuePtr value)
+{
+    if (DYNAMIC_CAST(malInteger, value) || DYNAMIC_CAST(malStringBase, value) ||
+        DYNAMIC_CAST(malConstant, value)) {
+        return true;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, value)) {
+        value = hash->values();
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, value);
+    if (!seq) {
+        return false;
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (!isFoldable(*it)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//  Returns what a folded form evaluates to, or NULL if it isn't a constant.
+static malValuePtr constantValue(malValuePtr ast)
+{
+    if (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        if (list->isEmpty()) {
+            return ast;
+        }
+        if ((list->count() == 2) &&
+            isSpecial(list->item(0), malSymbol::Quote) &&
+            isFoldable(list->item(1))) {
+            return list->item(1);
+        }
+        return NULL;
+    }
+    if (DYNAMIC_CAST(malSymbol, ast) || DYNAMIC_CAST(malVector, ast)) {
+        return NULL;
+    }
+    const malHash* hash = DYNAMIC_CAST(malHash, ast);
+    if (hash && !hash->isEvaluated()) {
+        return NULL;
+    }
+    if (!isFoldable(ast)) {
+        return NULL;
+    }
+    return ast;
+}
+
+//  Returns a form that evaluates to value.
+static malValuePtr constantForm(malValuePtr value)
+{
+    if (DYNAMIC_CAST(malInteger, value) || DYNAMIC_CAST(malString, value) ||
+        DYNAMIC_CAST(malKeyword, value) || DYNAMIC_CAST(malConstant, value)) {
+        return value;
+    }
+    return mal::list(new malResolvedSymbol("quote"), value);
+}
+
+//  Folds items, returning false if any of them isn't then a constant.
+static bool foldItems(const malSequence* seq, int from, malValueVec& items,
+                      const FoldScope* scope, malEnv* env)
+{
+    bool isConstant = true;
+    for (int i = from; i < seq->count(); i++) {
+        items.push_back(fold(seq->item(i), scope, env));
+        isConstant = isConstant && constantValue(items.back());
+    }
+    return isConstant;
+}
+
+//  Returns the pure builtin the global op names in env, or NULL.
+static malValuePtr pureBuiltin(malValuePtr op, malEnv* env)
+{
+    const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, op);
+    if (!sym || (sym->depth() >= 0)) {
+        return NULL;
+    }
+    malEnvPtr symEnv = env->find(sym->value());
+    if (!symEnv) {
+        return NULL;
+    }
+    malValuePtr value = symEnv->getOwn(sym->value());
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, value);
+    if (!builtin || !builtin->isPure()) {
+        return NULL;
+    }
+    return value;
+}
+
+//  Makes a call of a pure builtin with constant arguments, or returns the
+//  call as it is.
+static malValuePtr foldCall(malValueVec& items, malEnv* env)
+{
+    malValuePtr call = mal::list(items.data(), items.data() + items.size());
+    malValuePtr builtin = pureBuiltin(items[0], env);
+    if (!builtin) {
+        return call;
+    }
+    malValueVec args;
+    for (int i = 1; i < (int)items.size(); i++) {
+        malValuePtr arg = constantValue(items[i]);
+        if (!arg) {
+            return call;
+        }
+        args.push_back(arg);
+    }
+    try {
+        malValuePtr value = APPLY(builtin, args.data(),
+                                  args.data() + args.size());
+        return isFoldable(value) ? constantForm(value) : call;
+    }
+    catch (String&) {
+        return call; // let it fail when it's run
+    }
+    catch (malValuePtr&) {
+        return call;
+    }
+}
+
+//  Copies a resolved quasiquoted form, folding the forms unquoted in it.
+static malValuePtr foldTemplate(malValuePtr obj,
+                                const FoldScope* scope, malEnv* env)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
+    if (!seq) {
+        return obj;
+    }
+    if (malValuePtr unquoted = starts_with(obj, "unquote")) {
+        return mal::list(seq->item(0), fold(unquoted, scope, env));
+    }
+    malValueVec items;
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (malValuePtr spliced = starts_with(*it, "splice-unquote")) {
+            items.push_back(mal::list(STATIC_CAST(malList, *it)->item(0),
+                                      fold(spliced, scope, env)));
+        }
+        else {
+            items.push_back(foldTemplate(*it, scope, env));
+        }
+    }
+    malValueIter begin = items.data(), end = begin + items.size();
+    return DYNAMIC_CAST(malVector, obj) ? mal::vector(begin, end)
+                                        : mal::list(begin, end);
+}
+
+static malValuePtr foldSpecial(malValuePtr ast, const malSymbol* special,
+                               const FoldScope* scope, malEnv* env)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    int argCount = list->count() - 1;
+    malValueVec items(1, list->item(0));
+
+    switch (special->specialForm()) {
+    case malSymbol::If:
+        foldItems(list, 1, items, scope, env);
+        if ((argCount == 2) || (argCount == 3)) {
+            if (malValuePtr test = constantValue(items[1])) {
+                if (test->isTrue()) {
+                    return items[2];
+                }
+                return argCount == 3 ? items[3] : mal::nilValue();
+            }
+        }
+        break;
+
+    case malSymbol::And:
+    case malSymbol::Or: {
+        // An item that is constant either decides the result or can't.
+        bool isAnd = special->specialForm() == malSymbol::And;
+        foldItems(list, 1, items, scope, env);
+        int kept = 1;
+        for (int i = 1; i <= argCount; i++) {
+            malValuePtr value = constantValue(items[i]);
+            if (!value || (i == argCount) || (value->isTrue() != isAnd)) {
+                items[kept++] = items[i];
+            }
+            if (value && (value->isTrue() != isAnd)) {
+                break;
+            }
+        }
+        items.resize(kept);
+        if (kept == 1) {
+            return isAnd ? mal::trueValue() : mal::nilValue();
+        }
+        if (kept == 2) {
+            return items[1];
+        }
+        break;
+    }
+
+    case malSymbol::Do:
+    case malSymbol::Recur:
+        foldItems(list, 1, items, scope, env);
+        break;
+
+    case malSymbol::Quasiquote:
+        if (argCount != 1) {
+            return ast;
+        }
+        items.push_back(foldTemplate(list->item(1), scope, env));
+        break;
+
+    case malSymbol::Fn: {
+        if (!DYNAMIC_CAST(malBinder, list->item(0))) {
+            foldItems(list, 1, items, scope, env); // the clauses
+            break;
+        }
+        FoldScope inner = { NULL, scope };
+        items.push_back(list->item(1));
+        items.push_back(fold(list->item(2), &inner, env));
+        break;
+    }
+
+    case malSymbol::Let:
+    case malSymbol::Loop: {
+        // A recur binds the slots of a loop* again, so they aren't constant.
+        // Nor is a slot that the let* binds more than once, as a closure
+        // made before the last binding sees the value bound last.
+        bool isLet = special->specialForm() == malSymbol::Let;
+        const malBinder* binder = STATIC_CAST(malBinder, list->item(0));
+        const malSequence* bindings = STATIC_CAST(malSequence, list->item(1));
+        const malEnvShape* shape = binder->shape().ptr();
+        std::vector<int> bindCounts(shape->slotCount());
+        for (int i = 0; i < bindings->count(); i += 2) {
+            bindCounts[shape->bindingSlot(i / 2)]++;
+        }
+        malValueVec constants(shape->slotCount());
+        FoldScope inner = { isLet ? &constants : NULL, scope };
+        malValueVec folded;
+        for (int i = 0; i < bindings->count(); i += 2) {
+            malValuePtr init = fold(bindings->item(i + 1), &inner, env);
+            int slot = shape->bindingSlot(i / 2);
+            constants[slot] = bindCounts[slot] == 1 ? constantValue(init)
+                                                    : malValuePtr();
+            folded.push_back(bindings->item(i));
+            folded.push_back(init);
+        }
+        items.push_back(mal::vector(folded.data(),
+                                    folded.data() + folded.size()));
+        items.push_back(fold(list->item(2), &inner, env));
+        break;
+    }
+
+    case malSymbol::Try:
+        items.push_back(fold(list->item(1), scope, env));
+        if (argCount == 2) {
+            const malList* handler = STATIC_CAST(malList, list->item(2));
+            FoldScope inner = { NULL, scope };
+            items.push_back(mal::list(handler->item(0), handler->item(1),
+                                      fold(handler->item(2), &inner, env)));
+        }
+        break;
+
+    default:
+        return ast;
+    }
+    return mal::list(items.data(), items.data() + items.size());
+}
+
+malValuePtr fold(malValuePtr ast, const FoldScope* scope, malEnv* env)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, ast)) {
+        const FoldScope* frame = scope;
+        for (int depth = sym->depth(); frame && (depth > 0); depth--) {
+            frame = frame->outer;
+        }
+        if (frame && frame->constants && (sym->depth() >= 0)) {
+            if (malValuePtr value = (*frame->constants)[sym->slot()]) {
+                return constantForm(value);
+            }
+        }
+        return ast;
+    }
+
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        malValueVec items;
+        if (foldItems(vec, 0, items, scope, env)) {
+            for (auto& item : items) {
+                item = constantValue(item);
+            }
+            return constantForm(mal::vector(items.data(),
+                                            items.data() + items.size()));
+        }
+        return mal::vector(items.data(), items.data() + items.size());
+    }
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (hash->isEvaluated()) {
+            return ast;
+        }
+        malValuePtr keyList = hash->keys();
+        const malSequence* keys = STATIC_CAST(malSequence, keyList);
+        malValueVec items;
+        bool isConstant = true;
+        for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+            malValuePtr value = fold(hash->get(*it), scope, env);
+            malValuePtr constant = constantValue(value);
+            isConstant = isConstant && constant;
+            items.push_back(*it);
+            items.push_back(constant ? constant : value);
+        }
+        return isConstant ?
+            constantForm(mal::hash(items.data(), items.data() + items.size(),
+                                   true)) :
+            mal::hash(items.data(), items.data() + items.size(), false);
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return ast;
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        if (!DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            return ast; // left as written by the resolver
+        }
+        if (sym->specialForm() != malSymbol::NotSpecial) {
+            return foldSpecial(ast, sym, scope, env);
+        }
+    }
+
+    malValueVec items;
+    foldItems(list, 0, items, scope, env);
+    return foldCall(items, env);
+}
@@ -0,0 +1,15 @@
+#ifndef INCLUDE_FOLD_H
+#define INCLUDE_FOLD_H
+
+#include "MAL.h"
+
+// The frames the form being folded will make, innermost first, with the
+// constants that a let* frame's slots are bound to.
+struct FoldScope {
+    const malValueVec* constants;
+    const FoldScope*   outer;
+};
+
+extern malValuePtr fold(malValuePtr ast, const FoldScope* scope, malEnv* env);
+
+#endif // INCLUDE_FOLD_H
@@ -0,0 +1,573 @@
+#include "Jit.h"
+#include "Compiler.h"
+#include "Environment.h"
+#include "Resolver.h"
+#include "Runtime.h"
+#include "Types.h"
+#include "VM.h"
+
+#include <set>
+
+// The JIT makes x86-64 code, which it runs from memory it gets from mmap.
+#if defined(__x86_64__) && defined(__linux__)
+#define MAL_JIT
+#include <csetjmp>
+#include <cstring>
+
+#include <sys/mman.h>
+#endif
+
+//  Hot lambdas whose bodies are simple integer code are compiled once more,
+//  to x86-64 machine code that works on unboxed integers. The code can hold
+//  integer constants, the parameters, ifs whose tests compare two integers,
+//  +, - and * of two integers, and calls of global lambdas whose bodies are
+//  such code too, which call their machine code directly. A call of the
+//  lambda itself in tail position jumps back to the start.
+//
+//  The guards are checked when the interpreter calls the code: the arguments
+//  must be integers, and every global that the code or the code it calls
+//  uses must still hold what it did when the code was made. Nothing the code
+//  does can change a global. If a guard fails, or the code runs low on
+//  stack, the call deoptimizes: the interpreter runs it from the start, which
+//  is safe as the code has no side effects, and the lambda goes back to its
+//  interpreted body until that is resolved again.
+
+#ifdef MAL_JIT
+namespace {
+    // Thrown for a body the JIT can't compile.
+    class Unjittable { };
+
+    // A block of machine code, made executable once it's written.
+    class malMachineCode : public RefCounted {
+    public:
+        typedef int64_t (*Entry)(int64_t, int64_t, int64_t,
+                                 int64_t, int64_t, int64_t);
+
+        malMachineCode(const std::vector<uint8_t>& code);
+        ~malMachineCode();
+
+        // NULL if the memory for it couldn't be had.
+        Entry entry() const { return m_entry; }
+
+    private:
+        Entry        m_entry;
+        const size_t m_size;
+    };
+    typedef RefCountedPtr<malMachineCode> malMachineCodePtr;
+
+    malMachineCode::malMachineCode(const std::vector<uint8_t>& code)
+        : m_entry(NULL), m_size(code.size())
+    {
+        void* block = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            return;
+        }
+        memcpy(block, code.data(), m_size);
+        if (mprotect(block, m_size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(block, m_size);
+            return;
+        }
+        m_entry = (Entry)block;
+    }
+
+    malMachineCode::~malMachineCode()
+    {
+        if (m_entry) {
+            munmap((void*)m_entry, m_size);
+        }
+    }
+
+    // A global the machine code relies on, and the value it relies on.
+    struct malJitGuard {
+        malVarCellPtr cell;
+        malValuePtr   value;
+    };
+    typedef std::vector<malJitGuard> malJitGuardVec;
+
+    // The body of a lambda that the JIT has compiled.
+    class malJitCode : public malValue {
+    public:
+        malJitCode(const malLambda* lambda, malValuePtr fallback,
+                   malMachineCodePtr code, const malJitGuardVec& guards,
+                   const std::vector<malMachineCodePtr>& callees)
+            : m_lambda(lambda), m_fallback(fallback), m_code(code)
+            , m_guards(guards), m_callees(callees) { }
+        malJitCode(const malJitCode& that, malValuePtr meta)
+            : malValue(meta), m_lambda(that.m_lambda)
+            , m_fallback(that.m_fallback), m_code(that.m_code)
+            , m_guards(that.m_guards), m_callees(that.m_callees) { }
+
+        // Runs the machine code on the lambda's arguments in env.
+        virtual malValuePtr eval(malEnvPtr env);
+
+        const malMachineCodePtr& machineCode() const { return m_code; }
+        const malJitGuardVec& guards() const { return m_guards; }
+
+        virtual String print(bool readably) const {
+            return STRF("#jit-code(%p)", this);
+        }
+
+        virtual bool doIsEqualTo(const malValue* rhs) const {
+            return this == rhs;
+        }
+
+        WITH_META(malJitCode);
+
+    private:
+        malValuePtr deoptimize(malEnvPtr env);
+
+        const malLambda* const                 m_lambda;
+        const malValuePtr                      m_fallback;
+        const malMachineCodePtr                m_code;
+        const malJitGuardVec                   m_guards;
+        const std::vector<malMachineCodePtr>   m_callees;
+    };
+
+    // Where the machine code goes back to when it runs low on stack.
+    jmp_buf* s_jitBail = NULL;
+
+    __attribute__((noreturn)) void jitBail()
+    {
+        longjmp(*s_jitBail, 1);
+    }
+
+    malValuePtr malJitCode::eval(malEnvPtr env)
+    {
+        const malEnvShape* shape = m_lambda->getShape().ptr();
+        int64_t args[6] = { 0, 0, 0, 0, 0, 0 };
+        for (int i = 0, n = shape->fixedCount(); i < n; i++) {
+            malValuePtr arg = env->slot(shape->bindingSlot(i));
+            if (typeid(*arg.ptr()) != typeid(malInteger)) {
+                return m_fallback->eval(env);
+            }
+            args[i] = STATIC_CAST(malInteger, arg)->value();
+        }
+        for (auto& guard : m_guards) {
+            if (guard.cell->value() != guard.value) {
+                return deoptimize(env);
+            }
+        }
+
+        jmp_buf bail;
+        jmp_buf* outer = s_jitBail;
+        s_jitBail = &bail;
+        if (setjmp(bail) != 0) {
+            s_jitBail = outer;
+            return deoptimize(env);
+        }
+        int64_t result = m_code->entry()(args[0], args[1], args[2],
+                                         args[3], args[4], args[5]);
+        s_jitBail = outer;
+        return mal::integer(result);
+    }
+
+    //  Puts the interpreted body back in the lambda, and runs it.
+    malValuePtr malJitCode::deoptimize(malEnvPtr env)
+    {
+        malValuePtr fallback = m_fallback;
+        if (m_lambda->getBody().ptr() == this) {
+            m_lambda->setResolvedBody(fallback, malEnv::resolveEpoch());
+        }
+        return fallback->eval(env);
+    }
+
+    // Compiles the resolved body of a lambda to x86-64 code, for the System V
+    // calling convention. Each expression leaves its value in rax, with rcx
+    // for the right hand operand, and the parameters live in the frame.
+    class malJitCompiler {
+    public:
+        malJitCompiler(const malLambda* lambda,
+                       std::set<const malLambda*>& compiling)
+            : m_lambda(lambda), m_compiling(compiling), m_bodyStart(0) { }
+
+        // Makes the lambda's body its machine code, or throws Unjittable.
+        malValuePtr compile();
+
+    private:
+        void value(malValuePtr ast, bool isTail);
+        int test(malValuePtr ast);
+        void operands(const malList* list);
+        void call(const malList* list, bool isTail);
+        malMachineCodePtr callee(const malLambda* lambda);
+        malValuePtr guard(const String& name);
+        void addGuard(const malJitGuard& guard);
+
+        void emit(std::initializer_list<uint8_t> bytes);
+        void emit32(int32_t value);
+        void emit64(int64_t value);
+        void loadRax(int64_t value);
+        void frameAccess(uint8_t opcode, int reg, int slot);
+        void pop(int reg);
+        int jump(std::initializer_list<uint8_t> opcode);
+        void jumpTo(std::initializer_list<uint8_t> opcode, int target);
+        void land(int at);
+
+        const malLambda* const       m_lambda;
+        std::set<const malLambda*>&  m_compiling;
+        std::vector<uint8_t>         m_code;
+        int                          m_bodyStart;
+        std::vector<int>             m_bails;
+        malJitGuardVec               m_guards;
+        std::vector<malMachineCodePtr> m_callees;
+    };
+
+    // Registers numbered as in the instruction encoding.
+    enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9 };
+
+    // The registers the first six integer arguments come in.
+    const int argRegs[] = { RDI, RSI, RDX, RCX, R8, R9 };
+
+    malValuePtr malJitCompiler::compile()
+    {
+        const malEnvShape* shape = m_lambda->getShape().ptr();
+        int n = shape->fixedCount();
+        if (m_lambda->isMacro() || shape->hasRest() ||
+            (shape->slotCount() != n) || (n > 6) ||
+            (m_lambda->getEnv() != replEnv)) {
+            throw Unjittable();
+        }
+        malValuePtr fallback = lambdaBody(m_lambda);
+        if (!isCode(fallback) && !isBytecode(fallback)) {
+            throw Unjittable(); // run as written, or already compiled
+        }
+        m_compiling.insert(m_lambda);
+        malValuePtr body = resolveBody(m_lambda);
+
+        // push rbp; mov rbp, rsp; sub rsp, 8 * n
+        emit({ 0x55, 0x48, 0x89, 0xE5 });
+        if (n > 0) {
+            emit({ 0x48, 0x81, 0xEC });
+            emit32(8 * n);
+        }
+        // cmp rsp, [&s_stackLimit]; jb bail
+        loadRax((intptr_t)&s_stackLimit);
+        emit({ 0x48, 0x3B, 0x20 });
+        m_bails.push_back(jump({ 0x0F, 0x82 }));
+        for (int i = 0; i < n; i++) {
+            frameAccess(0x89, argRegs[i], shape->bindingSlot(i));
+        }
+        m_bodyStart = m_code.size();
+
+        value(body, true);
+        emit({ 0xC9, 0xC3 }); // leave; ret
+
+        // The bail out to jitBail, which needs an aligned stack.
+        for (int at : m_bails) {
+            land(at);
+        }
+        emit({ 0x48, 0x83, 0xE4, 0xF0 });
+        loadRax((intptr_t)&jitBail);
+        emit({ 0xFF, 0xD0 });
+
+        malMachineCodePtr code = new malMachineCode(m_code);
+        if (!code->entry()) {
+            throw Unjittable();
+        }
+        malValuePtr jit = new malJitCode(m_lambda, fallback, code,
+                                         m_guards, m_callees);
+        if (m_lambda->getBody() == fallback) {
+            m_lambda->setResolvedBody(jit, malEnv::resolveEpoch());
+        }
+        return jit;
+    }
+
+    //  Emits code leaving the integer value of ast in rax.
+    void malJitCompiler::value(malValuePtr ast, bool isTail)
+    {
+        if (typeid(*ast.ptr()) == typeid(malInteger)) {
+            loadRax(STATIC_CAST(malInteger, ast)->value());
+            return;
+        }
+        if (const malResolvedSymbol* sym =
+                DYNAMIC_CAST(malResolvedSymbol, ast)) {
+            if ((sym->depth() != 0) || (sym->slot() < 0)) {
+                throw Unjittable();
+            }
+            frameAccess(0x8B, RAX, sym->slot());
+            return;
+        }
+        const malList* list = DYNAMIC_CAST(malList, ast);
+        if (!list || list->isEmpty()) {
+            throw Unjittable();
+        }
+
+        const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+        if (head && (head->specialForm() == malSymbol::If) &&
+            (list->count() == 4)) {
+            int elseJump = test(list->item(1));
+            value(list->item(2), isTail);
+            int endJump = jump({ 0xE9 });
+            land(elseJump);
+            value(list->item(3), isTail);
+            land(endJump);
+            return;
+        }
+        if (head && (head->specialForm() != malSymbol::NotSpecial)) {
+            throw Unjittable();
+        }
+
+        malValuePtr builtin;
+        malIntOp::Kind intOp;
+        if (findIntOp(list->item(0), builtin, intOp)) {
+            if ((list->count() != 3) || (intOp > malIntOp::Multiply)) {
+                throw Unjittable();
+            }
+            operands(list);
+            switch (intOp) {
+                case malIntOp::Add:
+                    emit({ 0x48, 0x01, 0xC8 });         // add rax, rcx
+                    break;
+                case malIntOp::Subtract:
+                    emit({ 0x48, 0x29, 0xC8 });         // sub rax, rcx
+                    break;
+                default:
+                    emit({ 0x48, 0x0F, 0xAF, 0xC1 });   // imul rax, rcx
+                    break;
+            }
+            return;
+        }
+        call(list, isTail);
+    }
+
+    //  Emits code for the comparison ast, jumping when it's false. Returns
+    //  the jump, for land().
+    int malJitCompiler::test(malValuePtr ast)
+    {
+        const malList* list = DYNAMIC_CAST(malList, ast);
+        malValuePtr builtin;
+        malIntOp::Kind intOp;
+        if (!list || (list->count() != 3) ||
+            !findIntOp(list->item(0), builtin, intOp) ||
+            (intOp <= malIntOp::Multiply)) {
+            throw Unjittable();
+        }
+        operands(list);
+        emit({ 0x48, 0x39, 0xC8 }); // cmp rax, rcx
+
+        // The jcc that jumps when the comparison is false.
+        uint8_t condition;
+        switch (intOp) {
+            case malIntOp::Equal:       condition = 0x85; break; // jne
+            case malIntOp::Less:        condition = 0x8D; break; // jge
+            case malIntOp::LessEqual:   condition = 0x8F; break; // jg
+            case malIntOp::Greater:     condition = 0x8E; break; // jle
+            default:                        condition = 0x8C; break; // jl
+        }
+        return jump({ 0x0F, condition });
+    }
+
+    //  Emits code putting the two arguments of a call of an integer builtin
+    //  in rax and rcx, guarding the builtin.
+    void malJitCompiler::operands(const malList* list)
+    {
+        guard(STATIC_CAST(malSymbol, list->item(0))->value());
+        value(list->item(1), false);
+        malValuePtr rhs = list->item(2);
+        const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, rhs);
+        if ((typeid(*rhs.ptr()) == typeid(malInteger)) &&
+            (STATIC_CAST(malInteger, rhs)->value() ==
+             (int32_t)STATIC_CAST(malInteger, rhs)->value())) {
+            emit({ 0x48, 0xC7, 0xC1 }); // mov rcx, imm32
+            emit32(STATIC_CAST(malInteger, rhs)->value());
+        }
+        else if (sym && (sym->depth() == 0) && (sym->slot() >= 0)) {
+            frameAccess(0x8B, RCX, sym->slot());
+        }
+        else {
+            emit({ 0x50 });                     // push rax
+            value(rhs, false);
+            emit({ 0x48, 0x89, 0xC1, 0x58 });   // mov rcx, rax; pop rax
+        }
+    }
+
+    //  Emits a call of a global lambda whose body is machine code too.
+    void malJitCompiler::call(const malList* list, bool isTail)
+    {
+        const malResolvedSymbol* sym =
+            DYNAMIC_CAST(malResolvedSymbol, list->item(0));
+        if (!sym || (sym->depth() >= 0)) {
+            throw Unjittable();
+        }
+        malValuePtr op = guard(sym->value());
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        int n = list->count() - 1;
+        if (!lambda || lambda->isMacro() || (n > 6)) {
+            throw Unjittable();
+        }
+        try {
+            lambda = lambda->clause(n);
+        }
+        catch (String&) {
+            throw Unjittable();
+        }
+        const malEnvShape* shape = lambda->getShape().ptr();
+        if (shape->hasRest() || (shape->fixedCount() != n)) {
+            throw Unjittable();
+        }
+        malMachineCodePtr code;
+        if (lambda != m_lambda) {
+            code = callee(lambda);
+        }
+
+        for (int i = 1; i <= n; i++) {
+            value(list->item(i), false);
+            emit({ 0x50 }); // push rax
+        }
+        if ((lambda == m_lambda) && isTail) {
+            for (int i = n - 1; i >= 0; i--) {
+                pop(RAX);
+                frameAccess(0x89, RAX, shape->bindingSlot(i));
+            }
+            jumpTo({ 0xE9 }, m_bodyStart);
+            return;
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            pop(argRegs[i]);
+        }
+        if (lambda == m_lambda) {
+            jumpTo({ 0xE8 }, 0);
+        }
+        else {
+            loadRax((intptr_t)code->entry());
+            emit({ 0xFF, 0xD0 }); // call rax
+        }
+    }
+
+    //  Returns the machine code of lambda, compiling it now if need be, and
+    //  takes on its guards.
+    malMachineCodePtr malJitCompiler::callee(const malLambda* lambda)
+    {
+        malValuePtr body = lambdaBody(lambda);
+        if (!DYNAMIC_CAST(malJitCode, body)) {
+            if (m_compiling.count(lambda)) {
+                throw Unjittable(); // calls back into code being compiled
+            }
+            body = malJitCompiler(lambda, m_compiling).compile();
+        }
+        const malJitCode* jit = STATIC_CAST(malJitCode, body);
+        for (auto& guard : jit->guards()) {
+            if (guard.cell->value() != guard.value) {
+                throw Unjittable(); // its code is out of date
+            }
+            addGuard(guard);
+        }
+        m_callees.push_back(jit->machineCode());
+        return jit->machineCode();
+    }
+
+    //  Returns the value of a global, which the code can rely on.
+    malValuePtr malJitCompiler::guard(const String& name)
+    {
+        malJitGuard guard;
+        try {
+            guard.value = replEnv->get(name, guard.cell);
+        }
+        catch (String&) {
+            throw Unjittable();
+        }
+        addGuard(guard);
+        return guard.value;
+    }
+
+    void malJitCompiler::addGuard(const malJitGuard& guard)
+    {
+        for (auto& known : m_guards) {
+            if (known.cell == guard.cell) {
+                return;
+            }
+        }
+        m_guards.push_back(guard);
+    }
+
+    void malJitCompiler::emit(std::initializer_list<uint8_t> bytes)
+    {
+        m_code.insert(m_code.end(), bytes);
+    }
+
+    void malJitCompiler::emit32(int32_t value)
+    {
+        for (int i = 0; i < 4; i++) {
+            m_code.push_back((uint8_t)(value >> (8 * i)));
+        }
+    }
+
+    void malJitCompiler::emit64(int64_t value)
+    {
+        emit32((int32_t)value);
+        emit32((int32_t)(value >> 32));
+    }
+
+    //  mov rax, value
+    void malJitCompiler::loadRax(int64_t value)
+    {
+        if (value == (int32_t)value) {
+            emit({ 0x48, 0xC7, 0xC0 });
+            emit32(value);
+        }
+        else {
+            emit({ 0x48, 0xB8 });
+            emit64(value);
+        }
+    }
+
+    //  mov reg, [rbp - 8 * (slot + 1)] for opcode 0x8B, and the other way
+    //  round for 0x89.
+    void malJitCompiler::frameAccess(uint8_t opcode, int reg, int slot)
+    {
+        emit({ (uint8_t)(0x48 | (reg >= 8 ? 0x04 : 0)), opcode,
+               (uint8_t)(0x85 | ((reg & 7) << 3)) });
+        emit32(-8 * (slot + 1));
+    }
+
+    void malJitCompiler::pop(int reg)
+    {
+        if (reg >= 8) {
+            emit({ 0x41 });
+        }
+        emit({ (uint8_t)(0x58 | (reg & 7)) });
+    }
+
+    //  Emits a jump whose target is set later by land(), and returns it.
+    int malJitCompiler::jump(std::initializer_list<uint8_t> opcode)
+    {
+        emit(opcode);
+        int at = m_code.size();
+        emit32(0);
+        return at;
+    }
+
+    void malJitCompiler::jumpTo(std::initializer_list<uint8_t> opcode,
+                                int target)
+    {
+        emit(opcode);
+        emit32(target - ((int)m_code.size() + 4));
+    }
+
+    //  Makes the jump from jump() go to the code emitted next.
+    void malJitCompiler::land(int at)
+    {
+        int32_t offset = m_code.size() - (at + 4);
+        memcpy(&m_code[at], &offset, 4);
+    }
+}
+#endif // MAL_JIT
+
+//  Compiles lambda to machine code if its body allows.
+void jitLambda(const malLambda* lambda)
+{
+#ifdef MAL_JIT
+    std::set<const malLambda*> compiling;
+    try {
+        malJitCompiler(lambda, compiling).compile();
+    }
+    catch (Unjittable&) {
+    }
+    catch (Unresolvable&) {
+    }
+    catch (String&) {
+    }
+    catch (malValuePtr&) {
+    }
+#endif // MAL_JIT
+}
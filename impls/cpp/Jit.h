@@ -0,0 +1,11 @@
+#ifndef INCLUDE_JIT_H
+#define INCLUDE_JIT_H
+
+#include "MAL.h"
+
+class malLambda;
+
+// Compiles lambda to machine code if its body allows, where the JIT can.
+extern void jitLambda(const malLambda* lambda);
+
+#endif // INCLUDE_JIT_H
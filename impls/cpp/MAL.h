@@ -3,6 +3,7 @@
 
 #include "Debug.h"
 #include "RefCountedPtr.h"
+#include "SmallVector.h"
 #include "String.h"
 #include "Validation.h"
 
@@ -11,11 +12,21 @@
 class malValue;
 typedef RefCountedPtr<malValue>  malValuePtr;
 typedef std::vector<malValuePtr> malValueVec;
-typedef malValueVec::iterator    malValueIter;
+typedef malValuePtr*             malValueIter;
+
+// A few values on the stack, such as the arguments of a call, of which
+// there are seldom more than four.
+typedef SmallVector<malValuePtr, 4> malSmallVec;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
+class malEnvShape;
+typedef RefCountedPtr<malEnvShape> malEnvShapePtr;
+
+class malVarCell;
+typedef RefCountedPtr<malVarCell>  malVarCellPtr;
+
 // step*.cpp
 extern malValuePtr APPLY(malValuePtr op,
                          malValueIter argsBegin, malValueIter argsEnd);
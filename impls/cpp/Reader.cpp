@@ -5,6 +5,10 @@
 
 typedef std::regex              Regex;
 
+// With MAL_HASHCONS set in the environment, equal data read from any input
+// shares a single object, see mal::intern().
+static const bool hashCons = getenv("MAL_HASHCONS") != NULL;
+
 static const Regex intRegex("^[-+]?\\d+$");
 static const Regex closeRegex("[\\)\\]}]");
 
@@ -114,6 +118,7 @@ void Tokeniser::skipWhitespace()
 
 static malValuePtr readAtom(Tokeniser& tokeniser);
 static malValuePtr readForm(Tokeniser& tokeniser);
+static malValuePtr readValue(Tokeniser& tokeniser);
 static void readList(Tokeniser& tokeniser, malValueVec* items,
                       const String& end);
 static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol);
@@ -128,6 +133,12 @@ malValuePtr readStr(const String& input)
 }
 
 static malValuePtr readForm(Tokeniser& tokeniser)
+{
+    malValuePtr form = readValue(tokeniser);
+    return hashCons ? mal::intern(form) : form;
+}
+
+static malValuePtr readValue(Tokeniser& tokeniser)
 {
     MAL_CHECK(!tokeniser.eof(), "expected form, got EOF");
     String token = tokeniser.peek();
@@ -151,7 +162,7 @@ static malValuePtr readForm(Tokeniser& tokeniser)
         tokeniser.next();
         malValueVec items;
         readList(tokeniser, &items, "}");
-        return mal::hash(items.begin(), items.end(), false);
+        return mal::hash(items.data(), items.data() + items.size(), false);
     }
     return readAtom(tokeniser);
 }
@@ -0,0 +1,945 @@
+#include "Resolver.h"
+#include "Environment.h"
+#include "Fold.h"
+#include "Runtime.h"
+#include "Types.h"
+
+#include <algorithm>
+
+malValuePtr s_condMacro;
+
+static bool isSymbol(malValuePtr obj, const String& text)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
+    return sym && (sym->value() == text);
+}
+
+//  Return arg when ast matches ('sym, arg), else NULL.
+malValuePtr starts_with(const malValuePtr ast, const char* sym)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
+        return NULL;
+    checkArgsIs(sym, 1, list->count() - 1);
+    return list->item(1);
+}
+
+//  Returns the symbol quasiquote's expansion names, resolved if the form
+//  being expanded has been through the resolver.
+static malValuePtr qqSymbol(const String& name, bool isResolved)
+{
+    return isResolved ? new malResolvedSymbol(name) : mal::symbol(name);
+}
+
+malValuePtr quasiquote(malValuePtr obj, bool isResolved)
+{
+    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
+        return mal::list(qqSymbol("quote", isResolved), obj);
+
+    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
+    if (!seq)
+        return obj;
+
+    const malValuePtr unquoted = starts_with(obj, "unquote");
+    if (unquoted)
+        return unquoted;
+
+    malValuePtr res = mal::list(new malValueVec(0));
+    for (int i=seq->count()-1; 0<=i; i--) {
+        const malValuePtr elt     = seq->item(i);
+        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
+        if (spl_unq)
+            res = mal::list(qqSymbol("concat", isResolved), spl_unq, res);
+         else
+            res = mal::list(qqSymbol("cons", isResolved),
+                            quasiquote(elt, isResolved), res);
+    }
+    if (DYNAMIC_CAST(malVector, obj))
+        res = mal::list(qqSymbol("vec", isResolved), res);
+    return res;
+}
+
+//  The call that (-> x f (g a)) stands for, (g (f x) a), or for ->> with
+//  isLast, (g a (f x)).
+malValuePtr threadForm(const malList* list, bool isLast)
+{
+    malValuePtr acc = list->item(1);
+    for (int i = 2; i < list->count(); i++) {
+        const malList* form = DYNAMIC_CAST(malList, list->item(i));
+        if (!form) {
+            acc = mal::list(list->item(i), acc);
+            continue;
+        }
+        malValueVec items;
+        items.push_back(form->isEmpty() ? mal::nilValue() : form->item(0));
+        if (!isLast) {
+            items.push_back(acc);
+        }
+        for (int j = 1; j < form->count(); j++) {
+            items.push_back(form->item(j));
+        }
+        if (isLast) {
+            items.push_back(acc);
+        }
+        acc = mal::list(items.data(), items.data() + items.size());
+    }
+    return acc;
+}
+
+static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
+{
+    const malList* seq = DYNAMIC_CAST(malList, obj);
+    if (seq && !seq->isEmpty()) {
+        if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
+            if (malEnvPtr symEnv = env->find(sym->value())) {
+                malValuePtr value = sym->eval(symEnv);
+                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+                    return lambda->isMacro() ? lambda : NULL;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+{
+    while (const malLambda* macro = isMacroApplication(obj, env)) {
+        obj = expandMacroCall(macro, STATIC_CAST(malList, obj));
+    }
+    return obj;
+}
+
+//  Returns the expansion of a call to macro, expanding it only the first
+//  time the form is seen.
+malValuePtr expandMacroCall(const malLambda* macro, const malList* form)
+{
+    malValuePtr expansion = form->expansion(macro);
+    if (!expansion) {
+        expansion = applyMacro(macro, form);
+        form->setExpansion(macro, expansion);
+    }
+    return expansion;
+}
+
+malValuePtr applyMacro(const malLambda* macro, const malSequence* form)
+{
+    macro = macro->clause(form->count() - 1);
+    return EVAL(lambdaBody(macro),
+                macro->makeEnv(form->begin() + 1, form->end()));
+}
+
+//  and, or, -> and ->> were once macros, as defprotocol is in impls/lib, and
+//  like them are hidden by any binding of the same name, a defmacro!
+//  included. cond is still the prelude's macro, see isPreludeCond().
+bool isLibraryForm(malSymbol::SpecialForm form)
+{
+    switch (form) {
+    case malSymbol::And:
+    case malSymbol::Cond:
+    case malSymbol::DefProtocol:
+    case malSymbol::Or:
+    case malSymbol::ThreadFirst:
+    case malSymbol::ThreadLast:
+        return true;
+    default:
+        return false;
+    }
+}
+
+//  Whether sym is cond and value the prelude's macro for it, which runs as
+//  the special form. macroexpand still expands it, and any other binding of
+//  cond hides the special form as for the other library forms.
+bool isPreludeCond(const malSymbol* sym, const malValue* value)
+{
+    return (sym->specialForm() == malSymbol::Cond) &&
+           value && (value == s_condMacro.ptr());
+}
+
+bool isMacro(malValuePtr value)
+{
+    const malLambda* lambda = value ? DYNAMIC_CAST(malLambda, value) : NULL;
+    return lambda && lambda->isMacro();
+}
+
+//  The resolver rewrites a fn* or let* form once, before it is run. Macro
+//  calls are expanded, and references to locals become frame and slot
+//  numbers so they needn't be looked up by name. Anything it can't make
+//  sense of is left as written, to be evaluated as it always was.
+
+static malValuePtr resolveSymbol(const malSymbol* sym,
+                                 const Scope* scope, malEnv* env)
+{
+    String name = sym->value();
+    int depth = 0;
+    for (; scope; scope = scope->outer, depth++) {
+        int slot = scope->shape->slotOf(name);
+        if (slot >= 0) {
+            return new malResolvedSymbol(name, depth, slot, true);
+        }
+    }
+    for (; env->outer(); env = env->outer().ptr(), depth++) {
+        int slot = env->shape() ? env->shape()->slotOf(name) : -1;
+        if (slot >= 0) {
+            return new malResolvedSymbol(name, depth, slot, true);
+        }
+        if (env->getOwn(name)) {
+            break; // made by a def!, so it has to be looked up by name
+        }
+    }
+    return new malResolvedSymbol(name, -1, -1, true);
+}
+
+//  Returns the macro a list headed by sym would call, or NULL. A local of
+//  the same name hides the global one, but locals bound to macros are only
+//  seen once their frame exists.
+static const malLambda* resolveMacro(const malSymbol* sym,
+                                     const Scope* scope, malEnv* env)
+{
+    String name = sym->value();
+    for (; scope; scope = scope->outer) {
+        if (scope->shape->slotOf(name) >= 0) {
+            return NULL;
+        }
+    }
+    malEnvPtr symEnv = env->find(name);
+    if (!symEnv) {
+        return NULL;
+    }
+    malValuePtr value = symEnv->getOwn(name);
+    return isMacro(value) ? STATIC_CAST(malLambda, value) : NULL;
+}
+
+//  Whether sym names a local, or a global that exists now.
+static bool isBound(const malSymbol* sym, const Scope* scope, malEnv* env)
+{
+    for (; scope; scope = scope->outer) {
+        if (scope->shape->slotOf(sym->value()) >= 0) {
+            return true;
+        }
+    }
+    return env->find(sym->value());
+}
+
+//  Copies list, putting head in front and resolving the items from 'from'.
+static malValuePtr resolveItems(const malList* list, malValuePtr head,
+                                int from, const Scope* scope, malEnv* env)
+{
+    malValueVec items;
+    items.reserve(list->count());
+    items.push_back(head);
+    for (int i = 1; i < list->count(); i++) {
+        malValuePtr item = list->item(i);
+        items.push_back(i < from ? item : resolve(item, scope, env));
+    }
+    return mal::list(items.data(), items.data() + items.size());
+}
+
+bool symbolNames(const malSequence* seq, int step, StringVec& names)
+{
+    for (int i = 0; i < seq->count(); i += step) {
+        const malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(i));
+        if (!sym) {
+            return false;
+        }
+        names.push_back(sym->value());
+    }
+    return true;
+}
+
+//  Copies a quasiquoted form, resolving the forms unquoted in it.
+static malValuePtr resolveTemplate(malValuePtr obj,
+                                   const Scope* scope, malEnv* env)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
+    if (!seq) {
+        return obj;
+    }
+    if (malValuePtr unquoted = starts_with(obj, "unquote")) {
+        return mal::list(seq->item(0), resolve(unquoted, scope, env));
+    }
+    malValueVec items;
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (malValuePtr spliced = starts_with(*it, "splice-unquote")) {
+            items.push_back(mal::list(STATIC_CAST(malList, *it)->item(0),
+                                      resolve(spliced, scope, env)));
+        }
+        else {
+            items.push_back(resolveTemplate(*it, scope, env));
+        }
+    }
+    malValueIter begin = items.data(), end = begin + items.size();
+    return DYNAMIC_CAST(malVector, obj) ? mal::vector(begin, end)
+                                        : mal::list(begin, end);
+}
+
+//  The resolved (fn* params body), headed by a binder, or NULL if the
+//  params aren't all symbols.
+static malValuePtr resolveFn(malValuePtr paramList, malValuePtr body,
+                             const Scope* scope, malEnv* env)
+{
+    const malSequence* params = DYNAMIC_CAST(malSequence, paramList);
+    StringVec names;
+    if (!params || !symbolNames(params, 1, names)) {
+        return NULL;
+    }
+    unsigned epoch = malEnv::resolveEpoch();
+    malEnvShapePtr shape(new malEnvShape(names, true));
+    Scope inner = { shape.ptr(), scope };
+    return mal::list(new malBinder("fn*", shape, body, epoch), paramList,
+                     resolve(body, &inner, env));
+}
+
+static void checkRecur(malValuePtr ast, bool isTail, int arity);
+
+static void checkItemsRecur(const malSequence* seq, int from, int arity)
+{
+    for (int i = from; i < seq->count(); i++) {
+        checkRecur(seq->item(i), false, arity);
+    }
+}
+
+//  Checks the forms unquoted in a resolved quasiquoted form.
+static void checkTemplateRecur(malValuePtr obj, int arity)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
+    if (!seq) {
+        return;
+    }
+    if (malValuePtr unquoted = starts_with(obj, "unquote")) {
+        checkRecur(unquoted, false, arity);
+        return;
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (malValuePtr spliced = starts_with(*it, "splice-unquote")) {
+            checkRecur(spliced, false, arity);
+        }
+        else {
+            checkTemplateRecur(*it, arity);
+        }
+    }
+}
+
+//  Raises an error for a recur in resolved code that isn't in tail position
+//  of its loop*, or doesn't give each of its arity bindings a value. A
+//  nested loop* or fn* has checked its own body.
+static void checkRecur(malValuePtr ast, bool isTail, int arity)
+{
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        malValuePtr values = hash->values();
+        checkItemsRecur(STATIC_CAST(malSequence, values), 0, arity);
+        return;
+    }
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        checkItemsRecur(vec, 0, arity);
+        return;
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return;
+    }
+    const malResolvedSymbol* head =
+        DYNAMIC_CAST(malResolvedSymbol, list->item(0));
+    if (!head) {
+        if (!DYNAMIC_CAST(malSymbol, list->item(0))) {
+            checkItemsRecur(list, 0, arity);
+        }
+        return; // or left as written by the resolver
+    }
+    int last = list->count() - 1;
+    switch (head->specialForm()) {
+    case malSymbol::Recur:
+        MAL_CHECK(isTail, "recur must be in tail position of loop*");
+        MAL_CHECK(last == arity, "recur expects %d arguments, not %d",
+                  arity, last);
+        checkItemsRecur(list, 1, arity);
+        return;
+
+    case malSymbol::And:
+    case malSymbol::Do:
+    case malSymbol::Or:
+        for (int i = 1; i < last; i++) {
+            checkRecur(list->item(i), false, arity);
+        }
+        if (last > 0) {
+            checkRecur(list->item(last), isTail, arity);
+        }
+        return;
+
+    case malSymbol::If:
+        checkRecur(list->item(1), false, arity);
+        for (int i = 2; i <= last; i++) {
+            checkRecur(list->item(i), isTail, arity);
+        }
+        return;
+
+    case malSymbol::Let:
+        checkRecur(list->item(1), false, arity);
+        checkRecur(list->item(2), isTail, arity);
+        return;
+
+    case malSymbol::Quasiquote:
+        checkTemplateRecur(list->item(1), arity);
+        return;
+
+    case malSymbol::Try:
+        checkRecur(list->item(1), false, arity);
+        if (last == 2) {
+            checkRecur(STATIC_CAST(malList, list->item(2))->item(2),
+                       false, arity);
+        }
+        return;
+
+    case malSymbol::NotSpecial:
+        checkItemsRecur(list, 0, arity);
+        return;
+
+    default:
+        return; // fn*, loop* and the quoting forms
+    }
+}
+
+static malValuePtr resolveSpecial(malValuePtr ast, const malSymbol* special,
+                                  const Scope* scope, malEnv* env)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    int argCount = list->count() - 1;
+    malValuePtr head = new malResolvedSymbol(special->value());
+
+    switch (special->specialForm()) {
+    case malSymbol::Def:
+    case malSymbol::DefMacro:
+    case malSymbol::DefProtocol:
+        throw Unresolvable();
+
+    case malSymbol::And:
+    case malSymbol::Do:
+    case malSymbol::If:
+    case malSymbol::Or:
+        return resolveItems(list, head, 1, scope, env);
+
+    case malSymbol::Cond: {
+        // Made into nested ifs, which try the tests in turn just the same.
+        if (argCount % 2 != 0) {
+            return ast;
+        }
+        malValuePtr ifHead = new malResolvedSymbol("if");
+        malValuePtr form = mal::nilValue();
+        for (int i = argCount - 1; i >= 1; i -= 2) {
+            malValuePtr items[] = {
+                ifHead,
+                resolve(list->item(i), scope, env),
+                resolve(list->item(i + 1), scope, env),
+                form,
+            };
+            form = mal::list(items, items + 4);
+        }
+        return form;
+    }
+
+    case malSymbol::ThreadFirst:
+    case malSymbol::ThreadLast:
+        if (argCount == 0) {
+            return ast;
+        }
+        return resolve(threadForm(list, special->specialForm() ==
+                                        malSymbol::ThreadLast),
+                       scope, env);
+
+    case malSymbol::MacroExpand:
+    case malSymbol::QuasiquoteExpand:
+    case malSymbol::Quote:
+        return resolveItems(list, head, list->count(), scope, env);
+
+    case malSymbol::Quasiquote: {
+        if (argCount != 1) {
+            return ast;
+        }
+        malValuePtr form;
+        try {
+            form = resolveTemplate(list->item(1), scope, env);
+        }
+        catch (String&) {
+            return ast;
+        }
+        return mal::list(head, form);
+    }
+
+    case malSymbol::Fn: {
+        if (!hasClauses(list)) {
+            if (argCount != 2) {
+                return ast;
+            }
+            malValuePtr fn = resolveFn(list->item(1), list->item(2),
+                                       scope, env);
+            return fn ? fn : ast;
+        }
+        // Each clause becomes a resolved fn* of its own.
+        malValueVec items(1, head);
+        for (int i = 1; i <= argCount; i++) {
+            const malList* clause = DYNAMIC_CAST(malList, list->item(i));
+            if (!clause || (clause->count() != 2)) {
+                return ast;
+            }
+            malValuePtr fn = resolveFn(clause->item(0), clause->item(1),
+                                       scope, env);
+            if (!fn) {
+                return ast;
+            }
+            items.push_back(fn);
+        }
+        return mal::list(items.data(), items.data() + items.size());
+    }
+
+    case malSymbol::Let: {
+        const malSequence* bindings = argCount == 2 ?
+            DYNAMIC_CAST(malSequence, list->item(1)) : NULL;
+        StringVec names;
+        if (!bindings || (bindings->count() % 2 != 0) ||
+            !symbolNames(bindings, 2, names)) {
+            return ast;
+        }
+        malEnvShapePtr shape(new malEnvShape(names, false));
+        Scope inner = { shape.ptr(), scope, scope ? scope->loop : NULL };
+        malValueVec items;
+        for (int i = 0; i < bindings->count(); i += 2) {
+            items.push_back(bindings->item(i));
+            items.push_back(resolve(bindings->item(i+1), &inner, env));
+        }
+        return mal::list(new malBinder(special->value(), shape),
+                         mal::vector(items.data(), items.data() + items.size()),
+                         resolve(list->item(2), &inner, env));
+    }
+
+    case malSymbol::Loop: {
+        const malSequence* bindings = argCount == 2 ?
+            DYNAMIC_CAST(malSequence, list->item(1)) : NULL;
+        StringVec names;
+        if (!bindings || (bindings->count() % 2 != 0) ||
+            !symbolNames(bindings, 2, names)) {
+            return ast;
+        }
+        // The frame keeps the code of the body in a slot no symbol can
+        // name, for recur to go back to.
+        names.push_back(" body");
+        malEnvShapePtr shape(new malEnvShape(names, false));
+        Scope inner = { shape.ptr(), scope, NULL };
+        inner.loop = &inner;
+        malValueVec items;
+        for (int i = 0; i < bindings->count(); i += 2) {
+            items.push_back(bindings->item(i));
+            items.push_back(resolve(bindings->item(i+1), &inner, env));
+        }
+        malValuePtr body = resolve(list->item(2), &inner, env);
+        for (int i = 1; i < bindings->count(); i += 2) {
+            checkRecur(items[i], false, bindings->count() / 2);
+        }
+        checkRecur(body, true, bindings->count() / 2);
+        return mal::list(new malBinder(special->value(), shape),
+                         mal::vector(items.data(), items.data() + items.size()),
+                         body);
+    }
+
+    case malSymbol::Recur: {
+        MAL_CHECK(scope && scope->loop, "recur must be inside a loop*");
+        int depth = 0;
+        for (const Scope* frame = scope; frame != scope->loop;
+             frame = frame->outer) {
+            depth++;
+        }
+        return resolveItems(list, new malResolvedSymbol(special->value(),
+                                                        depth),
+                            1, scope, env);
+    }
+
+    case malSymbol::Try: {
+        if (argCount == 1) {
+            return resolveItems(list, head, 1, scope, env);
+        }
+        const malList* catchBlock = argCount == 2 ?
+            DYNAMIC_CAST(malList, list->item(2)) : NULL;
+        if (!catchBlock || catchBlock->count() != 3) {
+            return ast;
+        }
+        const malSymbol* catchSym =
+            DYNAMIC_CAST(malSymbol, catchBlock->item(0));
+        const malSymbol* excSym =
+            DYNAMIC_CAST(malSymbol, catchBlock->item(1));
+        if (!catchSym || catchSym->value() != "catch*" || !excSym) {
+            return ast;
+        }
+        StringVec names(1, excSym->value());
+        malEnvShapePtr shape(new malEnvShape(names, false));
+        Scope inner = { shape.ptr(), scope, scope ? scope->loop : NULL };
+        malValuePtr handler = mal::list(new malBinder("catch*", shape),
+                                        catchBlock->item(1),
+                                        resolve(catchBlock->item(2),
+                                                &inner, env));
+        return mal::list(head, resolve(list->item(1), scope, env), handler);
+    }
+
+    default:
+        return ast;
+    }
+}
+
+bool isSpecial(malValuePtr value, malSymbol::SpecialForm special)
+{
+    const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, value);
+    return sym && (sym->specialForm() == special);
+}
+
+//  Calls of small lambdas bound to globals are inlined: the call becomes the
+//  lambda's resolved body, with the arguments in place of its params. Only
+//  bodies made of calls, if, do, and and or are taken, as they make no frame
+//  of their own, and only arguments that can be put in place without
+//  changing whether or when they're evaluated: locals and constants, and
+//  one other argument if its param is used once, before anything else the
+//  body does could have an effect. A def! that replaces an inlined lambda
+//  has resolved code made again, see EVAL.
+
+// Bodies bigger than this, counting each symbol and constant, are called.
+static const int inlineMaxSize = 12;
+
+// The lambdas whose bodies are being resolved for inlining, innermost last,
+// so that none is inlined into itself, and inlining doesn't nest too deeply.
+static std::vector<const malLambda*> s_inlining;
+static const int inlineMaxDepth = 3;
+
+static int formSize(malValuePtr ast)
+{
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        ast = hash->values();
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, ast);
+    if (!seq) {
+        return 1;
+    }
+    int size = 0;
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        size += formSize(*it);
+    }
+    return size;
+}
+
+//  Whether name means the global of that name where scope is.
+static bool isGlobalAt(const String& name, const Scope* scope, malEnv* env)
+{
+    for (; scope; scope = scope->outer) {
+        if (scope->shape->slotOf(name) >= 0) {
+            return false;
+        }
+    }
+    malEnvPtr symEnv = env->find(name);
+    return !symEnv || !symEnv->outer();
+}
+
+//  Whether a resolved form can be evaluated at any time, any number of
+//  times, to the same effect: a constant, or a local or global.
+static bool isTrivial(malValuePtr ast, bool allowGlobals)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, ast)) {
+        return allowGlobals || (sym->depth() >= 0);
+    }
+    if (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        return !list->isEmpty() && isSpecial(list->item(0), malSymbol::Quote);
+    }
+    return DYNAMIC_CAST(malInteger, ast) || DYNAMIC_CAST(malString, ast) ||
+           DYNAMIC_CAST(malKeyword, ast) || DYNAMIC_CAST(malConstant, ast);
+}
+
+//  The first item of a resolved list to evaluate, and the one after the
+//  last that is always evaluated, or false for a form the inliner doesn't
+//  take. Vectors and calls evaluate all their items in turn.
+static bool evaluatedItems(const malSequence* seq, int& from, int& to)
+{
+    from = 0;
+    to = seq->count();
+    const malResolvedSymbol* head = dynamic_cast<const malList*>(seq) ?
+        DYNAMIC_CAST(malResolvedSymbol, seq->item(0)) : NULL;
+    switch (head ? head->specialForm() : malSymbol::NotSpecial) {
+    case malSymbol::NotSpecial:
+        return true;
+    case malSymbol::Do:
+        from = 1;
+        return true;
+    case malSymbol::And:
+    case malSymbol::If:
+    case malSymbol::Or:
+        from = 1;
+        to = std::min(to, 2);
+        return true;
+    default:
+        return false;
+    }
+}
+
+//  Whether body, a lambda's resolved body, can be inlined where scope is,
+//  counting the uses of each of its params in uses.
+static bool canInline(malValuePtr body, const String& name,
+                      std::vector<int>& uses, const Scope* scope, malEnv* env)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, body)) {
+        if (sym->depth() == 0) {
+            uses[sym->slot()]++;
+            return true;
+        }
+        return (sym->depth() < 0) && (sym->value() != name) &&
+               isGlobalAt(sym->value(), scope, env);
+    }
+    if (DYNAMIC_CAST(malSymbol, body)) {
+        return false; // left as written by the resolver
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, body)) {
+        if (hash->isEvaluated()) {
+            return true;
+        }
+        body = hash->values();
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, body);
+    if (!seq || seq->isEmpty() || isTrivial(body, false)) {
+        return true;
+    }
+    int from, to;
+    if (!evaluatedItems(seq, from, to)) {
+        return false;
+    }
+    for (int i = from; i < seq->count(); i++) {
+        if (!canInline(seq->item(i), name, uses, scope, env)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool usesSlot(malValuePtr ast, int slot)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, ast)) {
+        return (sym->depth() == 0) && (sym->slot() == slot);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        ast = hash->values();
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, ast);
+    if (!seq || isTrivial(ast, false)) {
+        return false;
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (usesSlot(*it, slot)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//  Whether the only use of slot in body comes before anything that could
+//  have an effect, so the argument for it can go in its place.
+static bool isLeading(malValuePtr body, int slot)
+{
+    if (DYNAMIC_CAST(malHash, body)) {
+        return false;
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, body);
+    if (!seq) {
+        return usesSlot(body, slot);
+    }
+    int from, to;
+    evaluatedItems(seq, from, to);
+    for (int i = from; i < to; i++) {
+        if (usesSlot(seq->item(i), slot)) {
+            return isLeading(seq->item(i), slot);
+        }
+        if (!isTrivial(seq->item(i), true)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+//  Copies body, putting args in place of the params they're for.
+static malValuePtr substitute(malValuePtr body, const malValueVec& args)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, body)) {
+        return sym->depth() == 0 ? args[sym->slot()] : body;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, body)) {
+        if (hash->isEvaluated()) {
+            return body;
+        }
+        malValuePtr keyList = hash->keys();
+        const malSequence* keys = STATIC_CAST(malSequence, keyList);
+        malValueVec items;
+        for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+            items.push_back(*it);
+            items.push_back(substitute(hash->get(*it), args));
+        }
+        return mal::hash(items.data(), items.data() + items.size(), false);
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, body);
+    if (!seq || isTrivial(body, false)) {
+        return body;
+    }
+    malValueVec items;
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        items.push_back(substitute(*it, args));
+    }
+    malValueIter begin = items.data(), end = begin + items.size();
+    return DYNAMIC_CAST(malVector, body) ? mal::vector(begin, end)
+                                         : mal::list(begin, end);
+}
+
+//  Returns the body of the lambda that a resolved call calls, with the
+//  call's arguments in place, or NULL if the call can't be inlined.
+static malValuePtr inlineCall(const malList* call,
+                              const Scope* scope, malEnv* env)
+{
+    const malResolvedSymbol* op =
+        DYNAMIC_CAST(malResolvedSymbol, call->item(0));
+    if (!s_inlineCalls || !op || (op->depth() >= 0) ||
+        ((int)s_inlining.size() >= inlineMaxDepth) ||
+        !isGlobalAt(op->value(), scope, env)) {
+        return NULL;
+    }
+    malEnvPtr opEnv = env->find(op->value());
+    malValuePtr value = opEnv ? opEnv->getOwn(op->value()) : malValuePtr();
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+    if (!lambda || lambda->isMacro() ||
+        (std::find(s_inlining.begin(), s_inlining.end(), lambda) !=
+         s_inlining.end())) {
+        return NULL;
+    }
+
+    int argCount = call->count() - 1;
+    const malLambda* clause;
+    try {
+        clause = lambda->clause(argCount);
+    }
+    catch (String&) {
+        return NULL; // let it fail when it's run
+    }
+    const malEnvShape* shape = clause->getShape().ptr();
+    if (clause->getEnv()->outer() || shape->hasRest() ||
+        (shape->slotCount() != argCount) ||
+        (formSize(clause->getSourceBody()) > inlineMaxSize)) {
+        return NULL;
+    }
+
+    malValuePtr body;
+    s_inlining.push_back(lambda);
+    try {
+        Scope inner = { shape, NULL, NULL };
+        body = resolve(clause->getSourceBody(), &inner,
+                       clause->getEnv().ptr());
+    }
+    catch (Unresolvable&) { }
+    catch (String&) { }
+    s_inlining.pop_back();
+
+    std::vector<int> uses(argCount);
+    if (!body || (formSize(body) > inlineMaxSize) ||
+        !canInline(body, op->value(), uses, scope, env)) {
+        return NULL;
+    }
+    bool hasEffects = false;
+    malValueVec args(argCount);
+    for (int i = 0; i < argCount; i++) {
+        int slot = shape->bindingSlot(i);
+        args[slot] = call->item(i + 1);
+        if (isTrivial(args[slot], false)) {
+            continue;
+        }
+        if (hasEffects || (uses[slot] != 1) || !isLeading(body, slot)) {
+            return NULL;
+        }
+        hasEffects = true;
+    }
+    lambda->setInlined();
+    return substitute(body, args);
+}
+
+malValuePtr resolve(malValuePtr ast, const Scope* scope, malEnv* env)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, ast)) {
+        return resolveSymbol(sym, scope, env);
+    }
+
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        malValueVec items;
+        for (auto it = vec->begin(), end = vec->end(); it != end; ++it) {
+            items.push_back(resolve(*it, scope, env));
+        }
+        return mal::vector(items.data(), items.data() + items.size());
+    }
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (hash->isEvaluated()) {
+            return ast;
+        }
+        malValuePtr keyList = hash->keys();
+        const malSequence* keys = STATIC_CAST(malSequence, keyList);
+        malValueVec items;
+        for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+            items.push_back(*it);
+            items.push_back(resolve(hash->get(*it), scope, env));
+        }
+        return mal::hash(items.data(), items.data() + items.size(), false);
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return ast;
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        const malLambda* macro = resolveMacro(sym, scope, env);
+        bool preludeCond = isPreludeCond(sym, macro);
+        if (macro && !preludeCond) {
+            malValuePtr expansion;
+            try {
+                expansion = expandMacroCall(macro, list);
+            }
+            catch (String&) {
+                return ast; // let it fail when it's run
+            }
+            catch (malValuePtr&) {
+                return ast;
+            }
+            return resolve(expansion, scope, env);
+        }
+
+        if ((sym->specialForm() != malSymbol::NotSpecial) &&
+            (preludeCond || !(isLibraryForm(sym->specialForm()) &&
+                              isBound(sym, scope, env)))) {
+            return resolveSpecial(ast, sym, scope, env);
+        }
+    }
+
+    malValuePtr call = resolveItems(list, resolve(list->item(0), scope, env),
+                                    1, scope, env);
+    if (malValuePtr body = inlineCall(STATIC_CAST(malList, call),
+                                      scope, env)) {
+        return body;
+    }
+    return call;
+}
+
+//  Resolves a form about to be evaluated in env, or returns it unchanged.
+malValuePtr resolveForm(malValuePtr ast, malEnvPtr env)
+{
+    try {
+        return fold(resolve(ast, NULL, env.ptr()), NULL, env.ptr());
+    }
+    catch (Unresolvable&) {
+        return ast;
+    }
+}
+
+//  Resolves and folds the body of lambda, or throws Unresolvable.
+malValuePtr resolveBody(const malLambda* lambda)
+{
+    Scope scope = { lambda->getShape().ptr(), NULL };
+    FoldScope params = { NULL, NULL };
+    return fold(resolve(lambda->getSourceBody(), &scope,
+                        lambda->getEnv().ptr()),
+                &params, lambda->getEnv().ptr());
+}
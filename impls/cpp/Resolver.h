@@ -0,0 +1,41 @@
+#ifndef INCLUDE_RESOLVER_H
+#define INCLUDE_RESOLVER_H
+
+#include "MAL.h"
+#include "Types.h"
+
+// The frames the form being resolved will make, innermost first. The frames
+// of the environment it's resolved in come after these.
+struct Scope {
+    const malEnvShape* shape;
+    const Scope*       outer;
+    const Scope*       loop;   // the loop* a recur here goes back to
+};
+
+// Resolved code can't cope with the frames changing under it, so a form
+// containing a def! or defmacro! is left as written.
+class Unresolvable { };
+
+// The prelude's cond macro. While cond is bound to it, EVAL and the resolver
+// treat cond as the special form, see isPreludeCond().
+extern malValuePtr s_condMacro;
+
+extern malValuePtr starts_with(const malValuePtr ast, const char* sym);
+extern malValuePtr quasiquote(malValuePtr obj, bool isResolved = false);
+extern malValuePtr threadForm(const malList* list, bool isLast);
+extern malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+extern malValuePtr expandMacroCall(const malLambda* macro,
+                                   const malList* form);
+extern malValuePtr applyMacro(const malLambda* macro,
+                              const malSequence* form);
+extern bool isLibraryForm(malSymbol::SpecialForm form);
+extern bool isPreludeCond(const malSymbol* sym, const malValue* value);
+extern bool isMacro(malValuePtr value);
+extern bool isSpecial(malValuePtr value, malSymbol::SpecialForm special);
+extern bool symbolNames(const malSequence* seq, int step, StringVec& names);
+
+extern malValuePtr resolve(malValuePtr ast, const Scope* scope, malEnv* env);
+extern malValuePtr resolveForm(malValuePtr ast, malEnvPtr env);
+extern malValuePtr resolveBody(const malLambda* lambda);
+
+#endif // INCLUDE_RESOLVER_H
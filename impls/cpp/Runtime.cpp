@@ -0,0 +1,138 @@
+#include "Runtime.h"
+#include "Compiler.h"
+#include "Environment.h"
+#include "Jit.h"
+#include "Resolver.h"
+#include "Types.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <typeinfo>
+
+#include <sys/resource.h>
+
+bool s_useVM = false;
+unsigned s_hotRuns = 1000;
+unsigned s_jitCalls = 1000;
+bool s_inlineCalls = true;
+size_t s_maxDepth = 1000000;
+uintptr_t s_stackLimit = 0;
+
+malEnvPtr replEnv(new malEnv);
+
+void (*s_compiledProgram)(malEnvPtr env) = NULL;
+
+//  Reads the runtime options from the environment, and notes where the C++
+//  stack starts from a local of the function that runs the interpreter.
+void configure(const void* stackTop)
+{
+    if (getenv("MAL_NO_FAST_PATHS")) {
+        s_hotRuns = 0;
+    }
+    if (getenv("MAL_NO_INLINE")) {
+        s_inlineCalls = false;
+    }
+    if (getenv("MAL_NO_JIT")) {
+        s_jitCalls = 0;
+    }
+    if (const char* depth = getenv("MAL_MAX_DEPTH")) {
+        s_maxDepth = std::max(atol(depth), 1L);
+    }
+
+    size_t size = 8 << 20;
+    struct rlimit limit;
+    if ((getrlimit(RLIMIT_STACK, &limit) == 0) &&
+        (limit.rlim_cur != RLIM_INFINITY)) {
+        size = limit.rlim_cur;
+    }
+    // Leave an eighth of it for unwinding, and for what builtins need.
+    s_stackLimit = (uintptr_t)stackTop - (size - size / 8);
+}
+
+void stackOverflow()
+{
+    MAL_FAIL("Stack overflow");
+}
+
+//  Makes a call of a protocol method or multimethod into a call of the
+//  function it picks for the arguments, so that a lambda gets a tail call
+//  like any other. Returns whether op was one.
+bool dispatch(malValuePtr& op,
+              malValueIter argsBegin, malValueIter argsEnd)
+{
+    // Most calls that get here are of builtins, and comparing the type is
+    // cheaper than a cast that fails.
+    const std::type_info& type = typeid(*op.ptr());
+    if (type == typeid(malProtocolMethod)) {
+        op = STATIC_CAST(malProtocolMethod, op)->implFor(argsBegin, argsEnd);
+        return true;
+    }
+    if (type == typeid(malMultiMethod)) {
+        op = STATIC_CAST(malMultiMethod, op)->methodFor(argsBegin, argsEnd);
+        return true;
+    }
+    return false;
+}
+
+//  Whether a fn* form has ([params] body) clauses, rather than params and a
+//  body. Params are symbols, so a list starting with a sequence can't be.
+bool hasClauses(const malList* list)
+{
+    const malList* clause = list->count() > 1 ?
+        DYNAMIC_CAST(malList, list->item(1)) : NULL;
+    return clause && !clause->isEmpty() &&
+           DYNAMIC_CAST(malSequence, clause->item(0));
+}
+
+malValuePtr makeLambda(malValuePtr paramList, malValuePtr body,
+                       malEnvPtr env)
+{
+    const malSequence* bindings = VALUE_CAST(malSequence, paramList);
+    StringVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        const malSymbol* sym = VALUE_CAST(malSymbol, bindings->item(i));
+        params.push_back(sym->value());
+    }
+
+    malValuePtr lambda = mal::lambda(params, body, env);
+    lambdaBody(STATIC_CAST(malLambda, lambda));
+    return lambda;
+}
+
+bool setCompiledProgram(void (*run)(malEnvPtr env))
+{
+    s_compiledProgram = run;
+    return true;
+}
+
+//  Compiles a resolved form and runs it in env.
+malValuePtr compileForm(malValuePtr ast, malEnvPtr env)
+{
+    if (s_useVM) {
+        return compileBytecode(ast)->eval(env);
+    }
+    return compileCode(ast)->eval(env);
+}
+
+//  Returns the body to run for lambda, compiling it first if need be, and
+//  to machine code once it's hot.
+malValuePtr lambdaBody(const malLambda* lambda)
+{
+    if (!lambda->isResolved()) {
+        unsigned epoch = malEnv::resolveEpoch();
+        malValuePtr body = lambda->getSourceBody();
+        try {
+            body = resolveBody(lambda);
+            body = s_useVM ? compileBytecode(body) : compileCode(body);
+        }
+        catch (Unresolvable&) {
+            // Run it as written.
+        }
+        lambda->setResolvedBody(body, epoch);
+    }
+    else if (lambda->countCall() == s_jitCalls) {
+        jitLambda(lambda);
+    }
+    return lambda->getBody();
+}
@@ -0,0 +1,63 @@
+#ifndef INCLUDE_RUNTIME_H
+#define INCLUDE_RUNTIME_H
+
+#include "MAL.h"
+
+#include <cstdint>
+
+class malLambda;
+class malList;
+
+// Set by --vm, to run compiled code on the bytecode VM.
+extern bool s_useVM;
+
+// How many runs make compiled code hot, or 0 to never compile it again with
+// fast paths, as when MAL_NO_FAST_PATHS is set.
+extern unsigned s_hotRuns;
+
+// How many calls of a lambda make the JIT compile it to machine code, or 0
+// to never do so, as when MAL_NO_JIT is set.
+extern unsigned s_jitCalls;
+
+// Whether the resolver inlines calls of small lambdas. Cleared by
+// MAL_NO_INLINE, and by --emit-cpp, whose program can't make its code again.
+extern bool s_inlineCalls;
+
+// How deep calls from bytecode to bytecode may nest in one run of the VM,
+// which keeps them on the heap. Set by MAL_MAX_DEPTH.
+extern size_t s_maxDepth;
+
+// The C++ stack is nearly used up below this address, see checkStack().
+extern uintptr_t s_stackLimit;
+
+// The environment that programs run in, and that globals live in.
+extern malEnvPtr replEnv;
+
+// The code of a program made by --emit-cpp, when one is linked in. main then
+// runs it in place of the REPL. The program sets it as it starts up, by way
+// of setCompiledProgram().
+extern void (*s_compiledProgram)(malEnvPtr env);
+extern bool setCompiledProgram(void (*run)(malEnvPtr env));
+
+extern void configure(const void* stackTop);
+extern void stackOverflow() __attribute__((noinline, cold));
+
+//  Raises an error when the C++ stack is nearly used up, so that deep
+//  recursion can be caught by try* rather than crash the interpreter.
+inline void checkStack()
+{
+    char here;
+    if ((uintptr_t)&here < s_stackLimit) {
+        stackOverflow();
+    }
+}
+
+extern bool dispatch(malValuePtr& op,
+                     malValueIter argsBegin, malValueIter argsEnd);
+extern bool hasClauses(const malList* list);
+extern malValuePtr makeLambda(malValuePtr paramList, malValuePtr body,
+                              malEnvPtr env);
+extern malValuePtr lambdaBody(const malLambda* lambda);
+extern malValuePtr compileForm(malValuePtr ast, malEnvPtr env);
+
+#endif // INCLUDE_RUNTIME_H
@@ -0,0 +1,35 @@
+#ifndef INCLUDE_SMALLVECTOR_H
+#define INCLUDE_SMALLVECTOR_H
+
+// A fixed number of T, kept in the object itself when there are no more
+// than N of them, and on the heap otherwise. Made on the stack, it holds a
+// few items without allocating anything.
+template<typename T, int N>
+class SmallVector
+{
+public:
+    explicit SmallVector(int size)
+    : m_data(size <= N ? m_inline : new T[size]), m_size(size) { }
+
+    ~SmallVector() {
+        if (m_data != m_inline) {
+            delete [] m_data;
+        }
+    }
+
+    T* begin() { return m_data; }
+    T* end()   { return m_data + m_size; }
+    int size() const { return m_size; }
+
+    T& operator [] (int index) { return m_data[index]; }
+
+private:
+    SmallVector(const SmallVector&);
+    SmallVector& operator = (const SmallVector&);
+
+    T   m_inline[N];
+    T*  m_data;
+    int m_size;
+};
+
+#endif // INCLUDE_SMALLVECTOR_H
@@ -3,8 +3,66 @@
 #include "Types.h"
 
 #include <algorithm>
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <typeinfo>
+#include <unordered_map>
+
+// The metadata of each value that has some, and the protocol type that its
+// :type names, once malProtocol::typeOf() has looked.
+struct MetaEntry {
+    malValuePtr meta;
+    int         type;
+};
+typedef std::unordered_map<const malValue*, MetaEntry> MetaTable;
+
+static MetaTable& metaTable()
+{
+    // Never destroyed, so values released during static destruction can
+    // still remove their entries.
+    static MetaTable* table = new MetaTable;
+    return *table;
+}
+
+// Interned values are found by content, and removed by identity when they
+// are destroyed. The table doesn't hold a reference to them.
+typedef std::unordered_multimap<size_t, malValue*> InternTable;
+
+static InternTable& internTable()
+{
+    static InternTable* table = new InternTable;
+    return *table;
+}
+
+// Only collections up to this size are interned.
+static const int internMaxItems = 16;
+
+static size_t combineHash(size_t hash, size_t value)
+{
+    return hash ^ (value + 0x9e3779b9 + (hash << 6) + (hash >> 2));
+}
+
+static bool isCanonical(const malValue* value)
+{
+    // The constants are singletons already.
+    return value->isInterned()
+        || (value == mal::nilValue().ptr())
+        || (value == mal::trueValue().ptr())
+        || (value == mal::falseValue().ptr());
+}
+
+static bool isSameValue(const malValue* a, const malValue* b)
+{
+    if ((typeid(*a) != typeid(*b)) || !a->isEqualTo(b)) {
+        return false;
+    }
+    // An unevaluated hash from the reader isn't interchangeable with an
+    // evaluated one, even if their contents are equal.
+    const malHash* hash = dynamic_cast<const malHash*>(a);
+    return !hash || (hash->isEvaluated() ==
+                     static_cast<const malHash*>(b)->isEvaluated());
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
@@ -35,20 +93,66 @@ namespace mal {
     }
 
     malValuePtr integer(int64_t value) {
-        return malValuePtr(new malInteger(value));
+        // Small integers are made so often, as counters and indexes, that
+        // a box is kept for each of them rather than made every time.
+        static const int64_t smallMin = -256, smallEnd = 1024;
+        static malValuePtr* small = NULL;
+        if ((value < smallMin) || (value >= smallEnd)) {
+            return malValuePtr(new malInteger(value));
+        }
+        if (!small) {
+            small = new malValuePtr[smallEnd - smallMin];
+            for (int64_t i = smallMin; i < smallEnd; i++) {
+                small[i - smallMin] = new malInteger(i);
+            }
+        }
+        return small[value - smallMin];
     };
 
     malValuePtr integer(const String& token) {
         return integer(std::stoi(token));
     };
 
+    malValuePtr intern(malValuePtr value) {
+        if (value->isInterned()) {
+            return value;
+        }
+        value = value->internItems();
+        if (!value->isInternable()) {
+            return value;
+        }
+
+        InternTable& table = internTable();
+        size_t hash = value->internHash();
+        for (auto range = table.equal_range(hash);
+             range.first != range.second; ++range.first) {
+            malValue* interned = range.first->second;
+            if (isSameValue(interned, value.ptr())) {
+                return interned;
+            }
+        }
+        table.insert(std::make_pair(hash, value.ptr()));
+        value->m_isInterned = true;
+        return value;
+    }
+
     malValuePtr keyword(const String& token) {
         return malValuePtr(new malKeyword(token));
     };
 
     malValuePtr lambda(const StringVec& bindings,
                        malValuePtr body, malEnvPtr env) {
-        return malValuePtr(new malLambda(bindings, body, env));
+        malEnvShapePtr shape(new malEnvShape(bindings, true));
+        return malValuePtr(new malLambda(shape, body, env));
+    }
+
+    malValuePtr lambda(malEnvShapePtr shape,
+                       malValuePtr body, malEnvPtr env) {
+        return malValuePtr(new malLambda(shape, body, env));
+    }
+
+    malValuePtr lambda(const malValueVec& clauses) {
+        return malValuePtr(new malLambda(clauses));
     }
 
     malValuePtr list(malValueVec* items) {
@@ -60,35 +164,37 @@ namespace mal {
     };
 
     malValuePtr list(malValuePtr a) {
-        malValueVec* items = new malValueVec(1);
-        items->at(0) = a;
-        return malValuePtr(new malList(items));
+        malValuePtr items[] = { a };
+        return malValuePtr(new malList(items, items + 1));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b) {
-        malValueVec* items = new malValueVec(2);
-        items->at(0) = a;
-        items->at(1) = b;
-        return malValuePtr(new malList(items));
+        malValuePtr items[] = { a, b };
+        return malValuePtr(new malList(items, items + 2));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c) {
-        malValueVec* items = new malValueVec(3);
-        items->at(0) = a;
-        items->at(1) = b;
-        items->at(2) = c;
-        return malValuePtr(new malList(items));
+        malValuePtr items[] = { a, b, c };
+        return malValuePtr(new malList(items, items + 3));
     }
 
     malValuePtr macro(const malLambda& lambda) {
         return malValuePtr(new malLambda(lambda, true));
     };
 
+    malValuePtr multiMethod(const String& name, malValuePtr dispatch) {
+        return malValuePtr(new malMultiMethod(name, dispatch));
+    }
+
     malValuePtr nilValue() {
         static malValuePtr c(new malConstant("nil"));
         return malValuePtr(c);
     };
 
+    malValuePtr protocol(const String& name, const StringVec& methods) {
+        return malValuePtr(new malProtocol(name, methods));
+    }
+
     malValuePtr string(const String& token) {
         return malValuePtr(new malString(token));
     }
@@ -163,6 +269,20 @@ malHash::malHash(const malHash::Map& map)
 
 }
 
+malHash::malHash(const malHash::Map& map, bool isEvaluated)
+: m_map(map)
+, m_isEvaluated(isEvaluated)
+{
+
+}
+
+malHash::~malHash()
+{
+    if (m_isInterned) {
+        forgetInterned();
+    }
+}
+
 malValuePtr
 malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
@@ -173,6 +293,25 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     return mal::hash(addToMap(map, argsBegin, argsEnd));
 }
 
+malValuePtr
+malHash::assocInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    // Check all the keys before changing anything.
+    StringVec keys;
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        keys.push_back(makeHashKey(*it));
+    }
+    auto value = argsBegin + 1;
+    for (auto it = keys.begin(), end = keys.end(); it != end; ++it) {
+        m_map[*it] = *value;
+        value += 2;
+    }
+    return malValuePtr(this);
+}
+
 bool malHash::contains(malValuePtr key) const
 {
     auto it = m_map.find(makeHashKey(key));
@@ -190,6 +329,19 @@ malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
     return mal::hash(map);
 }
 
+malValuePtr
+malHash::dissocInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    StringVec keys;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        keys.push_back(makeHashKey(*it));
+    }
+    for (auto it = keys.begin(), end = keys.end(); it != end; ++it) {
+        m_map.erase(*it);
+    }
+    return malValuePtr(this);
+}
+
 malValuePtr malHash::eval(malEnvPtr env)
 {
     if (m_isEvaluated) {
@@ -250,6 +402,45 @@ String malHash::print(bool readably) const
     return s + "}";
 }
 
+size_t malHash::internHash() const
+{
+    size_t hash = std::hash<size_t>()(m_map.size());
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        hash = combineHash(hash, std::hash<String>()(it->first));
+        hash = combineHash(hash, std::hash<malValue*>()(it->second.ptr()));
+    }
+    return hash;
+}
+
+malValuePtr malHash::internItems()
+{
+    malHash::Map map;
+    bool isChanged = false;
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        malValuePtr value = mal::intern(it->second);
+        isChanged = isChanged || (value != it->second);
+        map[it->first] = value;
+    }
+    if (!isChanged) {
+        return malValuePtr(this);
+    }
+    malValuePtr copy(new malHash(map, m_isEvaluated));
+    return m_hasMeta ? copy->withMeta(meta()) : copy;
+}
+
+bool malHash::isInternable() const
+{
+    if (m_hasMeta || (m_map.size() > internMaxItems)) {
+        return false;
+    }
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        if (!isCanonical(it->second.ptr())) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
     const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
@@ -270,32 +461,79 @@ bool malHash::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
-malLambda::malLambda(const StringVec& bindings,
+malLambda::malLambda(malEnvShapePtr shape,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
+: m_shape(shape)
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
+, m_variadic(NULL)
+, m_resolvedEpoch(0)
+, m_calls(0)
+, m_isInlined(false)
 {
 
 }
 
+malLambda::malLambda(const malValueVec& clauses)
+: m_isMacro(false)
+, m_clauses(clauses)
+, m_variadic(NULL)
+, m_resolvedEpoch(0)
+, m_calls(0)
+, m_isInlined(false)
+{
+    for (auto& value : m_clauses) {
+        const malLambda* clause = STATIC_CAST(malLambda, value);
+        const malEnvShape* shape = clause->m_shape.ptr();
+        if (shape->hasRest()) {
+            MAL_CHECK(!m_variadic, "fn* has more than one & rest clause");
+            m_variadic = clause;
+            continue;
+        }
+        int arity = shape->fixedCount();
+        if (arity >= (int)m_byArity.size()) {
+            m_byArity.resize(arity + 1);
+        }
+        MAL_CHECK(!m_byArity[arity],
+                  "fn* has more than one clause for %d arguments", arity);
+        m_byArity[arity] = clause;
+    }
+}
+
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
 : malApplicable(meta)
-, m_bindings(that.m_bindings)
+, m_shape(that.m_shape)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
+, m_clauses(that.m_clauses)
+, m_byArity(that.m_byArity)
+, m_variadic(that.m_variadic)
+, m_resolvedEpoch(0)
+, m_calls(0)
+, m_isInlined(false)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
-, m_bindings(that.m_bindings)
+: malApplicable(that.m_hasMeta ? that.meta() : malValuePtr())
+, m_shape(that.m_shape)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
+, m_clauses(that.m_clauses)
+, m_byArity(that.m_byArity)
+, m_variadic(that.m_variadic)
+, m_resolvedEpoch(0)
+, m_calls(0)
+, m_isInlined(false)
+{
+
+}
+
+malLambda::~malLambda()
 {
 
 }
@@ -303,7 +541,36 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
-    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    const malLambda* lambda = clause(std::distance(argsBegin, argsEnd));
+    return EVAL(lambda->getBody(), lambda->makeEnv(argsBegin, argsEnd));
+}
+
+const malLambda* malLambda::clauseFor(int argCount) const
+{
+    if ((argCount < (int)m_byArity.size()) && m_byArity[argCount]) {
+        return m_byArity[argCount];
+    }
+    MAL_CHECK(m_variadic, "fn* has no clause for %d arguments", argCount);
+    return m_variadic;
+}
+
+malValuePtr malLambda::getBody() const
+{
+    return isResolved() ? m_resolvedBody : m_body;
+}
+
+bool malLambda::isResolved() const
+{
+    return m_resolvedBody && (m_resolvedEpoch == malEnv::resolveEpoch());
+}
+
+void malLambda::setResolvedBody(malValuePtr body, unsigned epoch) const
+{
+    if (!m_resolvedBody || (epoch != m_resolvedEpoch)) {
+        m_calls = 0;
+    }
+    m_resolvedBody = body;
+    m_resolvedEpoch = epoch;
 }
 
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
@@ -313,7 +580,260 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
 
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
+    return malEnvPtr(new malEnv(m_env, m_shape, argsBegin, argsEnd));
+}
+
+void malLambda::rebindEnv(malEnvPtr& env,
+                          malValueIter argsBegin, malValueIter argsEnd) const
+{
+    // If no closure captured the frame we're replacing, reuse its storage.
+    if (env->refCount() == 1) {
+        env->rebind(m_env, m_shape, argsBegin, argsEnd);
+    }
+    else {
+        env = makeEnv(argsBegin, argsEnd);
+    }
+}
+
+namespace {
+    // The names of the kinds of value, by malValue::TypeTag.
+    const char* const s_kindNames[] = {
+        ":mal/symbol", ":mal/keyword", ":mal/atom", ":mal/nil",
+        ":mal/boolean", ":mal/number", ":mal/string", ":mal/macro",
+        ":mal/list", ":mal/vector", ":mal/map", ":mal/function",
+    };
+
+    // What each type has been given by extend: the implementation of each
+    // method, by method ID, and whether it extends each protocol, by ID.
+    struct TypeTable {
+        String            name;
+        malValueVec       methods;
+        std::vector<bool> protocols;
+    };
+
+    struct Protocols {
+        std::vector<TypeTable>       types;
+        std::map<String, int>        typeIds;
+        int                          protocolCount;
+        int                          methodCount;
+
+        Protocols() : protocolCount(0), methodCount(0) {
+            for (auto name : s_kindNames) {
+                typeIds[name] = types.size();
+                types.push_back(TypeTable());
+                types.back().name = name;
+            }
+        }
+    };
+}
+
+static Protocols& protocols()
+{
+    static Protocols* protocols = new Protocols;
+    return *protocols;
+}
+
+static int kindOf(const malValue* value)
+{
+    malValue::TypeTag tag = value->typeTag();
+    MAL_CHECK(tag != malValue::NoTag, "unknown MAL value in protocols");
+    return tag;
+}
+
+malProtocol::malProtocol(const String& name, const StringVec& methods)
+: m_name(name)
+, m_id(protocols().protocolCount++)
+{
+    for (auto& method : methods) {
+        m_methods.push_back(new malProtocolMethod(method,
+                                                  protocols().methodCount++));
+    }
+}
+
+malProtocol::malProtocol(const malProtocol& that, malValuePtr meta)
+: malValue(meta)
+, m_name(that.m_name)
+, m_id(that.m_id)
+, m_methods(that.m_methods)
+{
+
+}
+
+malProtocol::~malProtocol()
+{
+
+}
+
+void malProtocol::extend(int type, const malHash* methods) const
+{
+    TypeTable& table = protocols().types[type];
+    if (m_id >= (int)table.protocols.size()) {
+        table.protocols.resize(m_id + 1);
+    }
+    table.protocols[m_id] = true;
+    for (auto& value : m_methods) {
+        const malProtocolMethod* method =
+            static_cast<const malProtocolMethod*>(value.ptr());
+        malValuePtr impl = methods->get(mal::keyword(":" + method->name()));
+        if (method->id() >= (int)table.methods.size()) {
+            table.methods.resize(method->id() + 1);
+        }
+        table.methods[method->id()] = impl->isTrue() ? impl : malValuePtr();
+    }
+}
+
+bool malProtocol::isExtendedBy(int type) const
+{
+    const std::vector<bool>& extended = protocols().types[type].protocols;
+    return (m_id < (int)extended.size()) && extended[m_id];
+}
+
+int malProtocol::typeOf(const malValue* value)
+{
+    int kind = kindOf(value);
+    if (!value->m_hasMeta || (kind < malValue::ListTag) ||
+        (kind == malValue::MacroTag)) {
+        return kind;
+    }
+    // Metadata can't change, so its type is looked up only once.
+    MetaEntry& entry = metaTable().find(value)->second;
+    if (entry.type < 0) {
+        entry.type = kind;
+        if (const malHash* hash = DYNAMIC_CAST(malHash, entry.meta)) {
+            static const malValuePtr typeKey = mal::keyword(":type");
+            malValuePtr type = hash->get(typeKey);
+            if (const malKeyword* keyword = DYNAMIC_CAST(malKeyword, type)) {
+                entry.type = typeNamed(keyword->value());
+            }
+        }
+    }
+    return entry.type;
+}
+
+int malProtocol::typeNamed(const String& keyword)
+{
+    Protocols& all = protocols();
+    auto it = all.typeIds.find(keyword);
+    if (it != all.typeIds.end()) {
+        return it->second;
+    }
+    all.types.push_back(TypeTable());
+    all.types.back().name = keyword;
+    return all.typeIds[keyword] = all.types.size() - 1;
+}
+
+malValuePtr malProtocol::typeName(int type)
+{
+    return mal::keyword(protocols().types[type].name);
+}
+
+malValuePtr malProtocolMethod::apply(malValueIter argsBegin,
+                                     malValueIter argsEnd) const
+{
+    return APPLY(implFor(argsBegin, argsEnd), argsBegin, argsEnd);
+}
+
+malValuePtr malProtocolMethod::implFor(malValueIter argsBegin,
+                                       malValueIter argsEnd) const
+{
+    checkArgsAtLeast(m_name.c_str(), 1, std::distance(argsBegin, argsEnd));
+    int type = malProtocol::typeOf(argsBegin->ptr());
+    const malValueVec& methods = protocols().types[type].methods;
+    malValuePtr impl;
+    if (m_id < (int)methods.size()) {
+        impl = methods[m_id];
+    }
+    MAL_CHECK(impl, "%s has no implementation of %s",
+              protocols().types[type].name.c_str(), m_name.c_str());
+    return impl;
+}
+
+malMultiMethod::malMultiMethod(const malMultiMethod& that, malValuePtr meta)
+: malApplicable(meta)
+, m_name(that.m_name)
+, m_dispatch(that.m_dispatch)
+, m_methods(that.m_methods)
+{
+
+}
+
+malMultiMethod::~malMultiMethod()
+{
+
+}
+
+malValuePtr malMultiMethod::apply(malValueIter argsBegin,
+                                  malValueIter argsEnd) const
+{
+    return APPLY(methodFor(argsBegin, argsEnd), argsBegin, argsEnd);
+}
+
+malValuePtr malMultiMethod::methodFor(malValueIter argsBegin,
+                                      malValueIter argsEnd) const
+{
+    malValuePtr value = APPLY(m_dispatch, argsBegin, argsEnd);
+    malValuePtr method = methodForValue(value);
+    MAL_CHECK(method, "%s has no method for %s",
+              m_name.c_str(), value->print(true).c_str());
+    return method;
+}
+
+malValuePtr malMultiMethod::methodForValue(malValuePtr value) const
+{
+    // The cache holds on to the values in it, so no other value can be at
+    // the same address, and a match needs no compare of contents. A value
+    // equal to a cached one but elsewhere is found in the table instead.
+    CacheEntry& entry = m_cache[(uintptr_t)value.ptr() / 16 % cacheSize];
+    if (entry.value == value) {
+        return entry.method;
+    }
+
+    static const malValuePtr defaultValue = mal::keyword(":default");
+    auto it = m_methods.find(value);
+    if (it == m_methods.end()) {
+        it = m_methods.find(defaultValue);
+        if (it == m_methods.end()) {
+            return malValuePtr();
+        }
+    }
+
+    entry.value = value;
+    entry.method = it->second;
+    return it->second;
+}
+
+void malMultiMethod::addMethod(malValuePtr value, malValuePtr method)
+{
+    m_methods[value] = method;
+    for (auto& entry : m_cache) {
+        entry = CacheEntry();
+    }
+}
+
+void malMultiMethod::removeMethod(malValuePtr value)
+{
+    m_methods.erase(value);
+    for (auto& entry : m_cache) {
+        entry = CacheEntry();
+    }
+}
+
+size_t malMultiMethod::ValueHash::operator () (const malValuePtr& value) const
+{
+    // The intern hashes of collections go by the identity of their items,
+    // which equal collections needn't share. Sequences hash their items
+    // here instead, and maps, rare as dispatch values, only their size.
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, value)) {
+        size_t hash = std::hash<int>()(seq->count());
+        for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+            hash = combineHash(hash, (*this)(*it));
+        }
+        return hash;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, value)) {
+        return std::hash<int>()(hash->count());
+    }
+    return value->internHash();
 }
 
 malValuePtr malList::conj(malValueIter argsBegin,
@@ -329,6 +849,25 @@ malValuePtr malList::conj(malValueIter argsBegin,
     return mal::list(items);
 }
 
+malValuePtr malList::expansion(const malValue* macro) const
+{
+    if (m_expansion && (m_expansion->macro == macro) &&
+        (m_expansion->epoch == malEnv::resolveEpoch())) {
+        return m_expansion->form;
+    }
+    return NULL;
+}
+
+void malList::setExpansion(const malValue* macro, malValuePtr expansion) const
+{
+    if (!m_expansion) {
+        m_expansion.reset(new Expansion);
+    }
+    m_expansion->macro = macro;
+    m_expansion->epoch = malEnv::resolveEpoch();
+    m_expansion->form  = expansion;
+}
+
 malValuePtr malList::eval(malEnvPtr env)
 {
     // Note, this isn't actually called since the TCO updates, but
@@ -338,9 +877,9 @@ malValuePtr malList::eval(malEnvPtr env)
     }
 
     std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
+    auto it = items->data();
     malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    return APPLY(op, ++it, items->data() + items->size());
 }
 
 String malList::print(bool readably) const
@@ -348,14 +887,80 @@ String malList::print(bool readably) const
     return '(' + malSequence::print(readably) + ')';
 }
 
+malValue::malValue(malValuePtr meta)
+: m_hasMeta(meta)
+, m_isInterned(false)
+, m_isBorrowed(false)
+{
+    TRACE_OBJECT("Creating malValue %p\n", this);
+    if (m_hasMeta) {
+        metaTable()[this] = MetaEntry{ meta, -1 };
+    }
+}
+
+malValue::~malValue()
+{
+    TRACE_OBJECT("Destroying malValue %p\n", this);
+    if (m_hasMeta) {
+        // Hold on to the metadata until the entry is gone, so that any
+        // values it releases don't touch the table in the middle of erase.
+        auto it = metaTable().find(this);
+        malValuePtr meta = it->second.meta;
+        metaTable().erase(it);
+    }
+}
+
+malValue::TypeTag malConstant::typeTag() const
+{
+    return this == mal::nilValue().ptr() ? NilTag : BooleanTag;
+}
+
 malValuePtr malValue::eval(malEnvPtr env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
 }
 
+malInteger::~malInteger()
+{
+    if (m_isInterned) {
+        forgetInterned();
+    }
+}
+
+size_t malInteger::internHash() const
+{
+    return std::hash<int64_t>()(m_value);
+}
+
+malValuePtr malValue::internItems()
+{
+    return malValuePtr(this);
+}
+
+size_t malValue::internHash() const
+{
+    return std::hash<const malValue*>()(this);
+}
+
+void malValue::forgetInterned()
+{
+    InternTable& table = internTable();
+    for (auto range = table.equal_range(internHash());
+         range.first != range.second; ++range.first) {
+        if (range.first->second == this) {
+            table.erase(range.first);
+            return;
+        }
+    }
+}
+
 bool malValue::isEqualTo(const malValue* rhs) const
 {
+    if (this == rhs) {
+        return true;
+    }
+
     // Special-case. Vectors and Lists can be compared.
     bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
         (dynamic_cast<const malSequence*>(this) &&
@@ -372,7 +977,8 @@ bool malValue::isTrue() const
 
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    return m_hasMeta ? metaTable().find(this)->second.meta
+                     : mal::nilValue();
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
@@ -381,27 +987,72 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
 }
 
 malSequence::malSequence(malValueVec* items)
-: m_items(items)
+: m_items(NULL)
 {
-
+    adopt(items);
 }
 
 malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+: m_items(NULL)
 {
-
+    int count = end - begin;
+    if (count <= InlineCapacity) {
+        std::copy(begin, end, m_inline);
+        m_begin = m_inline;
+        m_end   = m_inline + count;
+    }
+    else {
+        adopt(new malValueVec(begin, end));
+    }
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
 : malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+, m_items(NULL)
 {
-
+    // Sequences are immutable, so the copy can share the items of the
+    // original rather than duplicating them.
+    if (that.m_begin != that.m_inline) {
+        m_owner = that.m_isBorrowed ? that.m_owner : &that;
+        m_owner->acquire();
+        m_isBorrowed = true;
+        m_begin = that.m_begin;
+        m_end   = that.m_end;
+    }
+    else {
+        std::copy(that.m_begin, that.m_end, m_inline);
+        m_begin = m_inline;
+        m_end   = m_inline + that.count();
+    }
 }
 
 malSequence::~malSequence()
 {
-    delete m_items;
+    if (m_isInterned) {
+        forgetInterned();
+    }
+    if (!m_isBorrowed) {
+        delete m_items;
+    }
+    else if (m_owner->release() == 0) {
+        delete m_owner;
+    }
+}
+
+void malSequence::adopt(malValueVec* items)
+{
+    int count = items->size();
+    if (count <= InlineCapacity) {
+        std::move(items->begin(), items->end(), m_inline);
+        delete items;
+        m_begin = m_inline;
+        m_end   = m_inline + count;
+    }
+    else {
+        m_items = items;
+        m_begin = m_items->data();
+        m_end   = m_begin + count;
+    }
 }
 
 bool malSequence::doIsEqualTo(const malValue* rhs) const
@@ -411,9 +1062,9 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
+    for (malValueIter it0 = m_begin,
                       it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+                      end = m_end; it0 != end; ++it0, ++it1) {
 
         if (! (*it0)->isEqualTo((*it1).ptr())) {
             return false;
@@ -426,12 +1077,77 @@ malValueVec* malSequence::evalItems(malEnvPtr env) const
 {
     malValueVec* items = new malValueVec;;
     items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+    for (auto it = m_begin, end = m_end; it != end; ++it) {
         items->push_back(EVAL(*it, env));
     }
     return items;
 }
 
+size_t malSequence::internHash() const
+{
+    // Lists and vectors hash alike, as typeid isn't usable from destructors.
+    size_t hash = std::hash<int>()(count());
+    for (auto it = m_begin, end = m_end; it != end; ++it) {
+        hash = combineHash(hash, std::hash<malValue*>()(it->ptr()));
+    }
+    return hash;
+}
+
+malValuePtr malSequence::internItems()
+{
+    malValueVec* items = new malValueVec;
+    items->reserve(count());
+    bool isChanged = false;
+    for (auto it = m_begin, end = m_end; it != end; ++it) {
+        items->push_back(mal::intern(*it));
+        isChanged = isChanged || (items->back() != *it);
+    }
+    if (!isChanged) {
+        delete items;
+        return malValuePtr(this);
+    }
+    malValuePtr copy = dynamic_cast<malVector*>(this) ? mal::vector(items)
+                                                      : mal::list(items);
+    return m_hasMeta ? copy->withMeta(meta()) : copy;
+}
+
+bool malSequence::isInternable() const
+{
+    if (m_hasMeta || (count() > internMaxItems)) {
+        return false;
+    }
+    for (auto it = m_begin, end = m_end; it != end; ++it) {
+        if (!isCanonical(it->ptr())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool malSequence::appendInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    if (m_isBorrowed) {
+        return false;
+    }
+
+    int count = this->count();
+    int newItemCount = std::distance(argsBegin, argsEnd);
+    if (m_begin == m_inline) {
+        if (count + newItemCount <= InlineCapacity) {
+            std::copy(argsBegin, argsEnd, m_end);
+            m_end += newItemCount;
+            return true;
+        }
+        m_items = new malValueVec;
+        m_items->reserve(2 * (count + newItemCount));
+        std::move(m_begin, m_end, std::back_inserter(*m_items));
+    }
+    m_items->insert(m_items->end(), argsBegin, argsEnd);
+    m_begin = m_items->data();
+    m_end   = m_begin + m_items->size();
+    return true;
+}
+
 malValuePtr malSequence::first() const
 {
     return count() == 0 ? mal::nilValue() : item(0);
@@ -440,8 +1156,8 @@ malValuePtr malSequence::first() const
 String malSequence::print(bool readably) const
 {
     String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
+    auto end = m_end;
+    auto it = m_begin;
     if (it != end) {
         str += (*it)->print(readably);
         ++it;
@@ -459,6 +1175,18 @@ malValuePtr malSequence::rest() const
     return mal::list(start, end());
 }
 
+malStringBase::~malStringBase()
+{
+    if (m_isInterned) {
+        forgetInterned();
+    }
+}
+
+size_t malStringBase::internHash() const
+{
+    return std::hash<String>()(m_value);
+}
+
 String malString::escapedValue() const
 {
     return escape(value());
@@ -474,6 +1202,118 @@ malValuePtr malSymbol::eval(malEnvPtr env)
     return env->get(value());
 }
 
+static constexpr int specialFormKey(int length, char first)
+{
+    return (length << 8) | (unsigned char)first;
+}
+
+malSymbol::SpecialForm malSymbol::specialFormOf(const String& name)
+{
+    // No two special forms share both a length and a first character, so
+    // those pick out the only candidate, and one compare confirms it. The
+    // compiler rejects duplicate case labels, so a new form that breaks
+    // this won't build.
+    #define SPECIAL_FORM(text, form) \
+        case specialFormKey(sizeof(text) - 1, text[0]): \
+            return name == text ? form : NotSpecial;
+
+    if (name.empty()) {
+        return NotSpecial;
+    }
+    switch (specialFormKey(name.length(), name[0])) {
+        SPECIAL_FORM("->",               ThreadFirst)
+        SPECIAL_FORM("->>",              ThreadLast)
+        SPECIAL_FORM("and",              And)
+        SPECIAL_FORM("cond",             Cond)
+        SPECIAL_FORM("def!",             Def)
+        SPECIAL_FORM("defmacro!",        DefMacro)
+        SPECIAL_FORM("defprotocol",      DefProtocol)
+        SPECIAL_FORM("do",               Do)
+        SPECIAL_FORM("fn*",              Fn)
+        SPECIAL_FORM("if",               If)
+        SPECIAL_FORM("let*",             Let)
+        SPECIAL_FORM("loop*",            Loop)
+        SPECIAL_FORM("macroexpand",      MacroExpand)
+        SPECIAL_FORM("or",               Or)
+        SPECIAL_FORM("quasiquote",       Quasiquote)
+        SPECIAL_FORM("quasiquoteexpand", QuasiquoteExpand)
+        SPECIAL_FORM("quote",            Quote)
+        SPECIAL_FORM("recur",            Recur)
+        SPECIAL_FORM("try*",             Try)
+        default:
+            return NotSpecial;
+    }
+    #undef SPECIAL_FORM
+}
+
+malBinder::malBinder(const String& token, malEnvShapePtr shape,
+                     malValuePtr sourceBody, unsigned epoch)
+: malResolvedSymbol(token)
+, m_shape(shape)
+, m_sourceBody(sourceBody)
+, m_epoch(epoch)
+{
+
+}
+
+malBinder::malBinder(const malBinder& that, malValuePtr meta)
+: malResolvedSymbol(that, meta)
+, m_shape(that.m_shape)
+, m_sourceBody(that.m_sourceBody)
+, m_epoch(that.m_epoch)
+{
+
+}
+
+malBinder::~malBinder()
+{
+
+}
+
+malResolvedSymbol::malResolvedSymbol(const String& token, int depth, int slot,
+                                     bool isReference)
+: malSymbol(token, isReference ? NotSpecial : specialFormOf(token))
+, m_depth(depth)
+, m_slot(slot)
+, m_globalEpoch(0)
+{
+
+}
+
+malResolvedSymbol::malResolvedSymbol(const malResolvedSymbol& that,
+                                     malValuePtr meta)
+: malSymbol(that, meta)
+, m_depth(that.m_depth)
+, m_slot(that.m_slot)
+, m_globalEpoch(0)
+{
+
+}
+
+malResolvedSymbol::~malResolvedSymbol()
+{
+
+}
+
+malValuePtr malResolvedSymbol::eval(malEnvPtr env)
+{
+    if (m_depth < 0) {
+        if (m_globalCell && (m_globalEpoch == malEnv::globalEpoch())) {
+            return m_globalCell->value();
+        }
+        m_globalCell = NULL;
+        m_globalEpoch = malEnv::globalEpoch();
+        return env->get(value(), m_globalCell);
+    }
+    malEnv* frame = env->frame(m_depth);
+    if (malValuePtr local = frame->slot(m_slot)) {
+        return local;
+    }
+    // A let* binding referring to one that hasn't been made yet sees
+    // whatever the name means further out, as it would have by name.
+    return frame->outer()->get(value());
+}
+
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
@@ -5,20 +5,22 @@
 
 #include <exception>
 #include <map>
+#include <memory>
+#include <unordered_map>
 
 class malEmptyInputException : public std::exception { };
 
+namespace mal {
+    malValuePtr intern(malValuePtr value);
+};
+
 class malValue : public RefCounted {
 public:
-    malValue() {
-        TRACE_OBJECT("Creating malValue %p\n", this);
-    }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue() : m_hasMeta(false), m_isInterned(false), m_isBorrowed(false) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
-    virtual ~malValue() {
-        TRACE_OBJECT("Destroying malValue %p\n", this);
-    }
+    malValue(malValuePtr meta);
+    virtual ~malValue();
 
     malValuePtr withMeta(malValuePtr meta) const;
     virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
@@ -26,16 +28,48 @@ public:
 
     bool isTrue() const;
 
+    // True when the caller holds the only reference, so that an update made
+    // in place can't be seen by anyone else.
+    bool isUnique() const {
+        return (refCount() == 1) && !m_hasMeta && !m_isInterned;
+    }
+
     bool isEqualTo(const malValue* rhs) const;
 
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual String print(bool readably) const = 0;
 
+    // The kinds of value that find-type tells apart, which are also the
+    // first types of protocols. Values that are internal to the evaluator
+    // have NoTag.
+    enum TypeTag {
+        SymbolTag, KeywordTag, AtomTag, NilTag, BooleanTag, NumberTag,
+        StringTag, MacroTag, ListTag, VectorTag, MapTag, FunctionTag,
+        NoTag,
+    };
+    virtual TypeTag typeTag() const { return NoTag; }
+
+    // Hash-consing support, see mal::intern().
+    bool isInterned() const { return m_isInterned; }
+    virtual bool isInternable() const { return false; }
+    virtual size_t internHash() const;
+    virtual malValuePtr internItems();
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
-    malValuePtr m_meta;
+    friend malValuePtr mal::intern(malValuePtr value);
+    friend class malProtocol;
+
+    // Must be called by the destructor of each class defining internHash().
+    void forgetInterned();
+
+    // Metadata is rare, so it is kept in a side table rather than in every
+    // value. These flags live in the padding after the refcount.
+    bool m_hasMeta;
+    bool m_isInterned;
+    bool m_isBorrowed;  // a sequence whose items are another's, see malSequence
 };
 
 template<class T>
@@ -67,6 +101,8 @@ public:
         return this == rhs; // these are singletons
     }
 
+    virtual TypeTag typeTag() const;
+
     WITH_META(malConstant);
 
 private:
@@ -78,6 +114,7 @@ public:
     malInteger(int64_t value) : m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
         : malValue(meta), m_value(that.m_value) { }
+    virtual ~malInteger();
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
@@ -89,6 +126,11 @@ public:
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
 
+    virtual bool isInternable() const { return !m_hasMeta; }
+    virtual size_t internHash() const;
+
+    virtual TypeTag typeTag() const { return NumberTag; }
+
     WITH_META(malInteger);
 
 private:
@@ -101,11 +143,20 @@ public:
         : m_value(token) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
         : malValue(meta), m_value(that.value()) { }
+    virtual ~malStringBase();
 
     virtual String print(bool readably) const { return m_value; }
 
     String value() const { return m_value; }
 
+    virtual bool isInternable() const { return !m_hasMeta; }
+    virtual size_t internHash() const;
+
+protected:
+    bool isInternedPair(const malValue* rhs) const {
+        return m_isInterned && rhs->isInterned();
+    }
+
 private:
     const String m_value;
 };
@@ -122,9 +173,12 @@ public:
     String escapedValue() const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malString*>(rhs)->value();
+        return isInternedPair(rhs) ? false // and not the same object
+             : value() == static_cast<const malString*>(rhs)->value();
     }
 
+    virtual TypeTag typeTag() const { return StringTag; }
+
     WITH_META(malString);
 };
 
@@ -136,26 +190,104 @@ public:
         : malStringBase(that, meta) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malKeyword*>(rhs)->value();
+        return isInternedPair(rhs) ? false // and not the same object
+             : value() == static_cast<const malKeyword*>(rhs)->value();
     }
 
+    virtual TypeTag typeTag() const { return KeywordTag; }
+
     WITH_META(malKeyword);
 };
 
 class malSymbol : public malStringBase {
 public:
+    // Worked out once when the symbol is made, so that evaluators can
+    // switch on it rather than compare strings.
+    enum SpecialForm {
+        NotSpecial, And, Cond, Def, DefMacro, DefProtocol, Do, Fn, If, Let,
+        Loop, MacroExpand, Or, Quasiquote, QuasiquoteExpand, Quote, Recur,
+        ThreadFirst, ThreadLast, Try,
+    };
+
     malSymbol(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(token), m_specialForm(specialFormOf(token)) { }
+    malSymbol(const String& token, SpecialForm specialForm)
+        : malStringBase(token), m_specialForm(specialForm) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_specialForm(that.m_specialForm) { }
 
     virtual malValuePtr eval(malEnvPtr env);
 
+    SpecialForm specialForm() const { return m_specialForm; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malSymbol*>(rhs)->value();
     }
 
+    // Symbols are code, not data, so they are never shared.
+    virtual bool isInternable() const { return false; }
+
+    virtual TypeTag typeTag() const { return SymbolTag; }
+
     WITH_META(malSymbol);
+
+protected:
+    static SpecialForm specialFormOf(const String& name);
+
+private:
+    const SpecialForm m_specialForm;
+};
+
+// A symbol in code that has been through stepA's resolver. Any macro call
+// around it has been expanded already, and if it names a local it knows the
+// frame and slot to find it in. Anything else is looked up by name.
+class malResolvedSymbol : public malSymbol {
+public:
+    // A reference to a local or global is never a special form, even if it
+    // has the name of one.
+    malResolvedSymbol(const String& token, int depth = -1, int slot = -1,
+                      bool isReference = false);
+    malResolvedSymbol(const malResolvedSymbol& that, malValuePtr meta);
+    virtual ~malResolvedSymbol();
+
+    virtual malValuePtr eval(malEnvPtr env);
+
+    // The frame and slot of a local, or -1 for a name looked up by name.
+    int depth() const { return m_depth; }
+    int slot() const { return m_slot; }
+
+    WITH_META(malResolvedSymbol);
+
+private:
+    const int m_depth;
+    const int m_slot;
+
+    // A global found by name is remembered until malEnv::globalEpoch()
+    // moves on.
+    mutable malVarCellPtr m_globalCell;
+    mutable unsigned      m_globalEpoch;
+};
+
+// The head of a resolved fn*, let* or catch* form, giving the shape of the
+// frame the form makes. For fn* it also keeps the body as written, and the
+// resolve epoch its resolved body is good for.
+class malBinder : public malResolvedSymbol {
+public:
+    malBinder(const String& token, malEnvShapePtr shape,
+              malValuePtr sourceBody = NULL, unsigned epoch = 0);
+    malBinder(const malBinder& that, malValuePtr meta);
+    virtual ~malBinder();
+
+    const malEnvShapePtr& shape() const { return m_shape; }
+    malValuePtr sourceBody() const { return m_sourceBody; }
+    unsigned epoch() const { return m_epoch; }
+
+    WITH_META(malBinder);
+
+private:
+    const malEnvShapePtr m_shape;
+    const malValuePtr    m_sourceBody;
+    const unsigned       m_epoch;
 };
 
 class malSequence : public malValue {
@@ -168,12 +300,12 @@ public:
     virtual String print(bool readably) const;
 
     malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    int count() const { return m_end - m_begin; }
+    bool isEmpty() const { return m_begin == m_end; }
+    malValuePtr item(int index) const { return m_begin[index]; }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    malValueIter begin() const { return m_begin; }
+    malValueIter end()   const { return m_end; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
@@ -183,8 +315,29 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    // Only for use on a unique sequence, see isUnique(). Returns false if
+    // the items are borrowed from another sequence and can't be changed.
+    bool appendInPlace(malValueIter argsBegin, malValueIter argsEnd);
+
+    virtual bool isInternable() const;
+    virtual size_t internHash() const;
+    virtual malValuePtr internItems();
+
 private:
-    malValueVec* const m_items;
+    void adopt(malValueVec* items);
+
+    // Short sequences keep their items in the same allocation as the
+    // header, longer ones in m_items. A with-meta copy of a longer one
+    // borrows the items of m_owner instead, which it holds a reference to.
+    enum { InlineCapacity = 4 };
+
+    malValueIter      m_begin;
+    malValueIter      m_end;
+    union {
+        malValueVec*       m_items;
+        const malSequence* m_owner;     // when m_isBorrowed
+    };
+    malValuePtr       m_inline[InlineCapacity];
 };
 
 class malList : public malSequence {
@@ -201,7 +354,26 @@ public:
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    // The expansion of this list by macro, or by the special form it
+    // names, remembered so that a form run many times is only expanded
+    // once. NULL if there's none for macro from the current resolve epoch.
+    malValuePtr expansion(const malValue* macro) const;
+    void setExpansion(const malValue* macro, malValuePtr expansion) const;
+
+    virtual TypeTag typeTag() const { return ListTag; }
+
     WITH_META(malList);
+
+private:
+    // The macro is only compared against, never called, so it isn't kept
+    // alive. Making a new macro starts a new epoch, so it can't be mistaken
+    // for an old one at the same address.
+    struct Expansion {
+        const malValue* macro;
+        unsigned        epoch;
+        malValuePtr     form;
+    };
+    mutable std::unique_ptr<Expansion> m_expansion;
 };
 
 class malVector : public malSequence {
@@ -218,6 +390,8 @@ public:
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    virtual TypeTag typeTag() const { return VectorTag; }
+
     WITH_META(malVector);
 };
 
@@ -228,6 +402,8 @@ public:
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
+
+    virtual TypeTag typeTag() const { return FunctionTag; }
 };
 
 class malHash : public malValue {
@@ -238,10 +414,16 @@ public:
     malHash(const malHash::Map& map);
     malHash(const malHash& that, malValuePtr meta)
     : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    virtual ~malHash();
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // Only for use on a unique hash, see isUnique().
+    malValuePtr assocInPlace(malValueIter argsBegin, malValueIter argsEnd);
+    malValuePtr dissocInPlace(malValueIter argsBegin, malValueIter argsEnd);
     bool contains(malValuePtr key) const;
+    int count() const { return m_map.size(); }
     malValuePtr eval(malEnvPtr env);
     malValuePtr get(malValuePtr key) const;
     malValuePtr keys() const;
@@ -251,10 +433,20 @@ public:
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    bool isEvaluated() const { return m_isEvaluated; }
+
+    virtual bool isInternable() const;
+    virtual size_t internHash() const;
+    virtual malValuePtr internItems();
+
+    virtual TypeTag typeTag() const { return MapTag; }
+
     WITH_META(malHash);
 
 private:
-    const Map m_map;
+    malHash(const malHash::Map& map, bool isEvaluated);
+
+    Map m_map;
     const bool m_isEvaluated;
 };
 
@@ -264,11 +456,12 @@ public:
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    malBuiltIn(const String& name, ApplyFunc* handler, bool isPure = false)
+    : m_name(name), m_handler(handler), m_isPure(isPure) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler)
+    , m_isPure(that.m_isPure) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -283,24 +476,53 @@ public:
 
     String name() const { return m_name; }
 
+    // Pure builtins have no side effects and never call back into mal, so
+    // their result depends on nothing but their arguments.
+    bool isPure() const { return m_isPure; }
+
     WITH_META(malBuiltIn);
 
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    const bool m_isPure;
 };
 
 class malLambda : public malApplicable {
 public:
-    malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(malEnvShapePtr shape, malValuePtr body, malEnvPtr env);
+    // A fn* of several ([params] body) clauses, each a lambda of its own.
+    malLambda(const malValueVec& clauses);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
+    virtual ~malLambda();
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
-    malValuePtr getBody() const { return m_body; }
+    // The lambda to call with argCount arguments: this one, or if it has
+    // clauses, the one for that many, or else the one with & rest.
+    const malLambda* clause(int argCount) const {
+        return m_clauses.empty() ? this : clauseFor(argCount);
+    }
+
+    // The body to evaluate: the resolved one while it's up to date,
+    // otherwise the body as written.
+    malValuePtr getBody() const;
+    malValuePtr getSourceBody() const { return m_body; }
+    const malEnvShapePtr& getShape() const { return m_shape; }
+    const malEnvPtr& getEnv() const { return m_env; }
+
+    bool isResolved() const;
+    void setResolvedBody(malValuePtr body, unsigned epoch) const;
+
+    // Counts the calls of the body since it was last resolved, for the JIT
+    // to find hot lambdas.
+    unsigned countCall() const { return ++m_calls; }
+
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
+    void rebindEnv(malEnvPtr& env,
+                   malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // do we need to do a deep inspection?
@@ -312,13 +534,166 @@ public:
 
     bool isMacro() const { return m_isMacro; }
 
+    virtual TypeTag typeTag() const {
+        return m_isMacro ? MacroTag : FunctionTag;
+    }
+
+    // Whether a call of this lambda has been inlined into resolved code,
+    // which a def! that replaces it has to have made again.
+    bool isInlined() const { return m_isInlined; }
+    void setInlined() const { m_isInlined = true; }
+
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
 private:
-    const StringVec   m_bindings;
-    const malValuePtr m_body;
-    const malEnvPtr   m_env;
-    const bool        m_isMacro;
+    const malLambda* clauseFor(int argCount) const;
+
+    const malEnvShapePtr m_shape;
+    const malValuePtr    m_body;
+    const malEnvPtr      m_env;
+    const bool           m_isMacro;
+
+    malValueVec                   m_clauses;
+    std::vector<const malLambda*> m_byArity;    // NULL for no clause
+    const malLambda*              m_variadic;
+
+    mutable malValuePtr  m_resolvedBody;
+    mutable unsigned     m_resolvedEpoch;
+    mutable unsigned     m_calls;
+    mutable bool         m_isInlined;
+};
+
+// A protocol made by defprotocol. Its methods call the implementation that
+// extend gave for the type of their first argument. The implementations are
+// kept in a table for each type, indexed by method ID, so a call is one
+// lookup whatever the number of types and protocols.
+class malProtocol : public malValue {
+public:
+    malProtocol(const String& name, const StringVec& methods);
+    malProtocol(const malProtocol& that, malValuePtr meta);
+    virtual ~malProtocol();
+
+    // The methods, in the order defprotocol gave them.
+    int methodCount() const { return m_methods.size(); }
+    malValuePtr method(int index) const { return m_methods[index]; }
+
+    // Gives type the implementations in methods, a hash from keywords that
+    // name methods to functions, in place of any it had before.
+    void extend(int type, const malHash* methods) const;
+    bool isExtendedBy(int type) const;
+
+    // The type of value as find-type names it: the keyword under :type in
+    // the metadata of a list, vector, hash or function, or else its kind,
+    // such as :mal/number.
+    static int typeOf(const malValue* value);
+    static int typeNamed(const String& keyword);
+    static malValuePtr typeName(int type);
+
+    virtual String print(bool readably) const {
+        return STRF("#protocol(%s)", m_name.c_str());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_id == static_cast<const malProtocol*>(rhs)->m_id;
+    }
+
+    WITH_META(malProtocol);
+
+private:
+    const String m_name;
+    const int    m_id;
+    malValueVec  m_methods;
+};
+
+class malProtocolMethod : public malApplicable {
+public:
+    malProtocolMethod(const String& name, int id) : m_name(name), m_id(id) { }
+    malProtocolMethod(const malProtocolMethod& that, malValuePtr meta)
+        : malApplicable(meta), m_name(that.m_name), m_id(that.m_id) { }
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    // The implementation to call with these arguments.
+    malValuePtr implFor(malValueIter argsBegin, malValueIter argsEnd) const;
+
+    virtual String print(bool readably) const {
+        return STRF("#protocol-method(%s)", m_name.c_str());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_id == static_cast<const malProtocolMethod*>(rhs)->m_id;
+    }
+
+    String name() const { return m_name; }
+    int id() const { return m_id; }
+
+    WITH_META(malProtocolMethod);
+
+private:
+    const String m_name;
+    const int    m_id;
+};
+
+// A multimethod made by defmulti. It calls the method that defmethod gave
+// for the value its dispatch function returns for the arguments, or else
+// the one given for :default. The methods are kept in a hash table by
+// dispatch value, and a few of the values last looked up are kept in a
+// small cache in front of it, which is emptied whenever the methods change.
+class malMultiMethod : public malApplicable {
+public:
+    malMultiMethod(const String& name, malValuePtr dispatch)
+        : m_name(name), m_dispatch(dispatch) { }
+    malMultiMethod(const malMultiMethod& that, malValuePtr meta);
+    virtual ~malMultiMethod();
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    // The method to call with these arguments.
+    malValuePtr methodFor(malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // The method for a dispatch value, or NULL if there is none.
+    malValuePtr methodForValue(malValuePtr value) const;
+
+    void addMethod(malValuePtr value, malValuePtr method);
+    void removeMethod(malValuePtr value);
+
+    virtual String print(bool readably) const {
+        return STRF("#multimethod(%s)", m_name.c_str());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malMultiMethod);
+
+private:
+    // Hashes values that are equal alike, as isEqualTo sees them.
+    struct ValueHash {
+        size_t operator () (const malValuePtr& value) const;
+    };
+    struct ValueEqual {
+        bool operator () (const malValuePtr& lhs,
+                          const malValuePtr& rhs) const {
+            return lhs->isEqualTo(rhs.ptr());
+        }
+    };
+    typedef std::unordered_map<malValuePtr, malValuePtr,
+                               ValueHash, ValueEqual> Methods;
+
+    struct CacheEntry {
+        malValuePtr value;
+        malValuePtr method;
+    };
+    static const int cacheSize = 8;
+
+    const String      m_name;
+    const malValuePtr m_dispatch;
+    Methods           m_methods;
+
+    mutable CacheEntry m_cache[cacheSize];
 };
 
 class malAtom : public malValue {
@@ -339,6 +714,8 @@ public:
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual TypeTag typeTag() const { return AtomTag; }
+
     WITH_META(malAtom);
 
 private:
@@ -357,13 +734,17 @@ namespace mal {
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(malEnvShapePtr, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malValueVec& clauses);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
+    malValuePtr multiMethod(const String& name, malValuePtr dispatch);
     malValuePtr nilValue();
+    malValuePtr protocol(const String& name, const StringVec& methods);
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
     malValuePtr trueValue();
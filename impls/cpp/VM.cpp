@@ -0,0 +1,940 @@
+#include "VM.h"
+#include "Compiler.h"
+#include "Environment.h"
+#include "Resolver.h"
+#include "Runtime.h"
+#include "Types.h"
+
+#include <algorithm>
+
+//  With --vm, resolved code is compiled to bytecode for a stack machine
+//  instead. Locals live in the same frames as they do for the closure
+//  trees, so a closure needs nothing more than the frame it was made in.
+
+namespace {
+    enum OpCode {
+        OP_CONST,           // k           push constant k
+        OP_LOCAL,           // d s k       push slot s of frame d
+        OP_LOCAL0,          // s k         push slot s of the current frame
+        OP_GLOBAL,          // k           push the global named by symbol k
+        OP_POP,             //             drop the top of the stack
+        OP_JUMP,            // to          jump to to
+        OP_JUMP_IF_FALSE,   // to          pop, and jump to to if false
+        OP_JUMP_IF_TRUE_OR_POP,  // to     jump to to if true, else pop
+        OP_JUMP_IF_FALSE_OR_POP, // to     jump to to if false, else pop
+        OP_CALL,            // n           call the op below n args
+        OP_TAIL_CALL,       // n           ditto, then return the result
+        OP_CALL_GLOBAL,     // k n         call global k with n args
+        OP_TAIL_CALL_GLOBAL,// k n         ditto, then return the result
+        OP_CALL_GLOBAL_JUMP_IF_FALSE, // k n to  call, then jump if false
+        OP_INT_OP,          // o k         do int op o on the top 2, if they
+                            //             are integers and global k is
+                            //             builtin k+1, else call global k
+        OP_INT_OP_JUMP_IF_FALSE, // o k to  ditto, then jump if false
+        OP_RETURN,          //             return the top of the stack
+        OP_ENTER,           // k           enter a frame shaped by binder k
+        OP_SET_SLOT,        // s           pop into slot s of current frame
+        OP_LEAVE,           //             go back to the frame entered from
+        OP_CLOSURE,         // k           make a lambda of binder k, code k+1
+        OP_CLAUSES,         // n           make a lambda of n clause lambdas
+        OP_VECTOR,          // n           make a vector of n items
+        OP_HASH,            // n           make a hash of n keys and values
+        OP_TEMPLATE,        // k n         fill template k with n holes
+        OP_EVAL,            // k           EVAL constant k
+        OP_TRY,             // k           run code k, catching into k+1, k+2
+        OP_TAIL_TRY,        // k           ditto, then return the result
+        OP_THROW,           // k           throw, if global k is builtin k+1
+        OP_RECUR,           // d n to      pop n into the loop d frames out
+    };
+
+    class malBytecode : public malValue {
+    public:
+        malBytecode(const std::vector<int>& code, const malValueVec& consts,
+                    int maxStack)
+            : m_code(code), m_consts(consts), m_maxStack(maxStack) { }
+        malBytecode(const malBytecode& that, malValuePtr meta)
+            : malValue(meta), m_code(that.m_code), m_consts(that.m_consts)
+            , m_maxStack(that.m_maxStack) { }
+
+        virtual malValuePtr eval(malEnvPtr env) { return rethrow(run(env)); }
+
+        // Runs the code, returning the thrown marker for a throw.
+        malValuePtr run(malEnvPtr env);
+
+        const int* code() const { return m_code.data(); }
+        const malValuePtr* consts() const { return m_consts.data(); }
+        int maxStack() const { return m_maxStack; }
+
+        virtual String print(bool readably) const {
+            return STRF("#bytecode(%p)", this);
+        }
+
+        virtual bool doIsEqualTo(const malValue* rhs) const {
+            return this == rhs;
+        }
+
+        WITH_META(malBytecode);
+
+    private:
+        const std::vector<int> m_code;
+        const malValueVec      m_consts;
+        const int              m_maxStack;
+    };
+
+    class malBytecodeCompiler {
+    public:
+        malBytecodeCompiler() : m_depth(0), m_maxDepth(0) { }
+
+        malValuePtr compileBody(malValuePtr ast) {
+            compile(ast, true);
+            return new malBytecode(m_code, m_consts, m_maxDepth);
+        }
+
+    private:
+        void compile(malValuePtr ast, bool isTail);
+        void compileSpecial(malValuePtr ast, const malSymbol* special,
+                            bool isTail);
+        void compileCall(const malList* list, bool isTail);
+        void compileEval(malValuePtr ast, bool isTail);
+
+        int constant(malValuePtr value) {
+            m_consts.push_back(value);
+            return m_consts.size() - 1;
+        }
+
+        void emit(int op) { m_code.push_back(op); }
+        void emit(int op, int a) { emit(op); emit(a); }
+        void emit(int op, int a, int b) { emit(op, a); emit(b); }
+
+        // Emits a jump, returning where to patch in its target.
+        int emitJump(int op) { emit(op, 0); return m_code.size() - 1; }
+        void patch(int at) { m_code[at] = m_code.size(); }
+
+        void push(int n = 1) {
+            m_depth += n;
+            m_maxDepth = std::max(m_maxDepth, m_depth);
+        }
+        void pop(int n = 1) { m_depth -= n; }
+
+        // Leaves the value just compiled as the result, if in tail position.
+        void end(bool isTail) {
+            if (isTail) {
+                emit(OP_RETURN);
+            }
+        }
+
+        std::vector<int> m_code;
+        malValueVec      m_consts;
+        int              m_depth;
+        int              m_maxDepth;
+        std::vector<int> m_loops;   // where each loop* being compiled starts
+    };
+}
+
+malValuePtr compileBytecode(malValuePtr ast)
+{
+    return malBytecodeCompiler().compileBody(ast);
+}
+
+void malBytecodeCompiler::compile(malValuePtr ast, bool isTail)
+{
+    if (const malResolvedSymbol* sym = DYNAMIC_CAST(malResolvedSymbol, ast)) {
+        if (sym->depth() == 0) {
+            emit(OP_LOCAL0, sym->slot(), constant(ast));
+        }
+        else if (sym->depth() > 0) {
+            emit(OP_LOCAL, sym->depth(), sym->slot());
+            emit(constant(ast));
+        }
+        else {
+            emit(OP_GLOBAL, constant(ast));
+        }
+        push();
+        end(isTail);
+        return;
+    }
+
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        for (auto it = vec->begin(), end = vec->end(); it != end; ++it) {
+            compile(*it, false);
+        }
+        emit(OP_VECTOR, vec->count());
+        pop(vec->count());
+        push();
+        end(isTail);
+        return;
+    }
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (!hash->isEvaluated()) {
+            malValuePtr keyList = hash->keys();
+            const malSequence* keys = STATIC_CAST(malSequence, keyList);
+            for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+                emit(OP_CONST, constant(*it));
+                push();
+                compile(hash->get(*it), false);
+            }
+            emit(OP_HASH, keys->count());
+            pop(2 * keys->count());
+            push();
+            end(isTail);
+            return;
+        }
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        if (DYNAMIC_CAST(malSymbol, ast)) {
+            compileEval(ast, isTail);
+            return;
+        }
+        emit(OP_CONST, constant(ast));
+        push();
+        end(isTail);
+        return;
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        if (!DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            compileEval(ast, isTail); // left as written by the resolver
+            return;
+        }
+        if (sym->specialForm() != malSymbol::NotSpecial) {
+            compileSpecial(ast, sym, isTail);
+            return;
+        }
+    }
+
+    compileCall(list, isTail);
+}
+
+void malBytecodeCompiler::compileSpecial(malValuePtr ast,
+                                         const malSymbol* special, bool isTail)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    int argCount = list->count() - 1;
+
+    switch (special->specialForm()) {
+    case malSymbol::And:
+    case malSymbol::Or:
+        if (argCount >= 1) {
+            // An item that decides the result jumps to the end with it.
+            int op = special->specialForm() == malSymbol::And ?
+                OP_JUMP_IF_FALSE_OR_POP : OP_JUMP_IF_TRUE_OR_POP;
+            std::vector<int> jumps;
+            for (int i = 1; i < argCount; i++) {
+                compile(list->item(i), false);
+                jumps.push_back(emitJump(op));
+                pop();
+            }
+            compile(list->item(argCount), isTail);
+            for (int at : jumps) {
+                patch(at);
+            }
+            if (!jumps.empty()) {
+                end(isTail);
+            }
+            return;
+        }
+        break;
+
+    case malSymbol::Do:
+        if (argCount >= 1) {
+            for (int i = 1; i < argCount; i++) {
+                compile(list->item(i), false);
+                emit(OP_POP);
+                pop();
+            }
+            compile(list->item(argCount), isTail);
+            return;
+        }
+        break;
+
+    case malSymbol::If:
+        if ((argCount == 2) || (argCount == 3)) {
+            // Compare and branch in one go when the test calls a global.
+            const malList* test = DYNAMIC_CAST(malList, list->item(1));
+            const malResolvedSymbol* op = test && !test->isEmpty() ?
+                DYNAMIC_CAST(malResolvedSymbol, test->item(0)) : NULL;
+            int elseJump;
+            malValuePtr builtin;
+            malIntOp::Kind intOp;
+            if (op && (test->count() == 3) &&
+                findIntOp(test->item(0), builtin, intOp)) {
+                compile(test->item(1), false);
+                compile(test->item(2), false);
+                int k = constant(test->item(0));
+                constant(builtin);
+                emit(OP_INT_OP_JUMP_IF_FALSE, intOp, k);
+                emit(0);
+                elseJump = m_code.size() - 1;
+                pop(2);
+            }
+            else if (op && (op->depth() < 0) &&
+                     (op->specialForm() == malSymbol::NotSpecial)) {
+                int n = test->count() - 1;
+                for (int i = 1; i <= n; i++) {
+                    compile(test->item(i), false);
+                }
+                emit(OP_CALL_GLOBAL_JUMP_IF_FALSE,
+                     constant(test->item(0)), n);
+                emit(0);
+                elseJump = m_code.size() - 1;
+                pop(n);
+            }
+            else {
+                compile(list->item(1), false);
+                elseJump = emitJump(OP_JUMP_IF_FALSE);
+                pop();
+            }
+
+            compile(list->item(2), isTail);
+            int endJump = isTail ? -1 : emitJump(OP_JUMP);
+            pop();
+            patch(elseJump);
+            if (argCount == 3) {
+                compile(list->item(3), isTail);
+            }
+            else {
+                emit(OP_CONST, constant(mal::nilValue()));
+                push();
+                end(isTail);
+            }
+            if (endJump >= 0) {
+                patch(endJump);
+            }
+            return;
+        }
+        break;
+
+    case malSymbol::Quote:
+        if (argCount == 1) {
+            emit(OP_CONST, constant(list->item(1)));
+            push();
+            end(isTail);
+            return;
+        }
+        break;
+
+    case malSymbol::Quasiquote:
+        if (argCount == 1) {
+            malValuePtr form = list->item(1);
+            if (malValuePtr unquoted = starts_with(form, "unquote")) {
+                compile(unquoted, isTail);
+                return;
+            }
+            malValueVec holes;
+            malValuePtr tmpl = makeTemplate(form, holes);
+            if (!tmpl) {
+                emit(OP_CONST, constant(form));
+            }
+            else {
+                for (auto& hole : holes) {
+                    compile(hole, false);
+                }
+                emit(OP_TEMPLATE, constant(tmpl), holes.size());
+                pop(holes.size());
+            }
+            push();
+            end(isTail);
+            return;
+        }
+        break;
+
+    case malSymbol::Fn:
+        if (DYNAMIC_CAST(malBinder, list->item(0))) {
+            int k = constant(list->item(0));
+            constant(compileBytecode(list->item(2)));
+            emit(OP_CLOSURE, k);
+            push();
+            end(isTail);
+            return;
+        }
+        if (DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            for (int i = 1; i <= argCount; i++) {
+                compile(list->item(i), false);
+            }
+            emit(OP_CLAUSES, argCount);
+            pop(argCount);
+            push();
+            end(isTail);
+            return;
+        }
+        break;
+
+    case malSymbol::Let:
+        if (const malBinder* binder = DYNAMIC_CAST(malBinder, list->item(0))) {
+            const malSequence* bindings =
+                STATIC_CAST(malSequence, list->item(1));
+            emit(OP_ENTER, constant(list->item(0)));
+            for (int i = 1; i < bindings->count(); i += 2) {
+                compile(bindings->item(i), false);
+                emit(OP_SET_SLOT, binder->shape()->bindingSlot(i / 2));
+                pop();
+            }
+            compile(list->item(2), isTail);
+            if (!isTail) {
+                emit(OP_LEAVE);
+            }
+            return;
+        }
+        break;
+
+    case malSymbol::Loop:
+        if (const malBinder* binder = DYNAMIC_CAST(malBinder, list->item(0))) {
+            const malSequence* bindings =
+                STATIC_CAST(malSequence, list->item(1));
+            emit(OP_ENTER, constant(list->item(0)));
+            for (int i = 1; i < bindings->count(); i += 2) {
+                compile(bindings->item(i), false);
+                emit(OP_SET_SLOT, binder->shape()->bindingSlot(i / 2));
+                pop();
+            }
+            m_loops.push_back(m_code.size());
+            compile(list->item(2), isTail);
+            m_loops.pop_back();
+            if (!isTail) {
+                emit(OP_LEAVE);
+            }
+            return;
+        }
+        break;
+
+    case malSymbol::Recur:
+        if (const malResolvedSymbol* sym =
+                DYNAMIC_CAST(malResolvedSymbol, list->item(0))) {
+            for (int i = 1; i <= argCount; i++) {
+                compile(list->item(i), false);
+            }
+            // It never goes on to what follows, so needs no end().
+            emit(OP_RECUR, sym->depth(), argCount);
+            emit(m_loops.back());
+            pop(argCount);
+            push();
+            return;
+        }
+        break;
+
+    case malSymbol::Try:
+        if (argCount == 1) {
+            compile(list->item(1), isTail);
+            return;
+        }
+        if (argCount == 2) {
+            const malList* handler = STATIC_CAST(malList, list->item(2));
+            int k = constant(compileBytecode(list->item(1)));
+            constant(handler->item(0));
+            constant(compileBytecode(handler->item(2)));
+            emit(isTail ? OP_TAIL_TRY : OP_TRY, k);
+            push();
+            return;
+        }
+        break;
+
+    default:
+        break;
+    }
+    // Leave EVAL to report the error, or to expand the macro.
+    compileEval(ast, isTail);
+}
+
+void malBytecodeCompiler::compileCall(const malList* list, bool isTail)
+{
+    int n = list->count() - 1;
+    const malResolvedSymbol* op =
+        DYNAMIC_CAST(malResolvedSymbol, list->item(0));
+    malValuePtr builtin;
+    if ((n == 1) && isThrowBuiltin(list->item(0), builtin)) {
+        compile(list->item(1), false);
+        int k = constant(list->item(0));
+        constant(builtin);
+        emit(OP_THROW, k);
+        end(isTail);
+        return;
+    }
+    malIntOp::Kind intOp;
+    if ((n == 2) && findIntOp(list->item(0), builtin, intOp)) {
+        compile(list->item(1), false);
+        compile(list->item(2), false);
+        int k = constant(list->item(0));
+        constant(builtin);
+        emit(OP_INT_OP, intOp, k);
+        pop(2);
+        push();
+        end(isTail);
+        return;
+    }
+    if (op && (op->depth() < 0)) {
+        for (int i = 1; i <= n; i++) {
+            compile(list->item(i), false);
+        }
+        emit(isTail ? OP_TAIL_CALL_GLOBAL : OP_CALL_GLOBAL,
+             constant(list->item(0)), n);
+        pop(n);
+        push();
+        return;
+    }
+
+    for (int i = 0; i <= n; i++) {
+        compile(list->item(i), false);
+    }
+    emit(isTail ? OP_TAIL_CALL : OP_CALL, n);
+    pop(n + 1);
+    push();
+}
+
+void malBytecodeCompiler::compileEval(malValuePtr ast, bool isTail)
+{
+    emit(OP_EVAL, constant(ast));
+    push();
+    end(isTail);
+}
+
+namespace {
+    // A call from bytecode to bytecode that the VM is running, kept on the
+    // heap so that recursion isn't limited by the C++ stack.
+    struct malCallFrame {
+        malValuePtr codeRef;   // the caller's code
+        const int*  pc;        // where the caller goes on
+        const int*  elsePc;    // or if the result is false, when not NULL
+        malEnvPtr   env;       // the caller's env
+        int         base;      // the caller's stack and outerEnvs, as below
+        int         envBase;
+    };
+}
+
+malValuePtr malBytecode::run(malEnvPtr env)
+{
+    checkStack();
+
+    // The code being run, which a tail call may replace.
+    malValuePtr codeRef = this;
+    const malBytecode* bytecode = this;
+    const int* pc = bytecode->code();
+    const malValuePtr* consts = bytecode->consts();
+
+    // The code being run has the stack from base up, and the envs of the
+    // let* forms it's in from envBase up in outerEnvs.
+    malValueVec stack(bytecode->maxStack());
+    malValuePtr* sp = stack.data();
+    std::vector<malEnvPtr> outerEnvs;
+    std::vector<malCallFrame> frames;
+    int base = 0;
+    int envBase = 0;
+
+    // Pops down to base. Values are let go as they're popped, so that they
+    // aren't kept from being updated in place.
+    #define POP_TO(base) { \
+        malValuePtr* to = (base); \
+        while (sp > to) { \
+            *--sp = NULL; \
+        } \
+    }
+
+    // Runs the code of the lambda op with the n arguments on top of the
+    // stack in place of the current code, or returns what op returns.
+    #define TAIL_CALL(op, n) { \
+        malValueIter argsBegin = sp - n; \
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op); \
+        if (!lambda && dispatch(op, argsBegin, sp)) { \
+            lambda = DYNAMIC_CAST(malLambda, op); \
+        } \
+        if (!lambda) { \
+            RETURN(APPLY(op, argsBegin, sp)); \
+        } \
+        lambda = lambda->clause(n); \
+        malValuePtr body = lambdaBody(lambda); \
+        lambda->rebindEnv(env, argsBegin, sp); \
+        const malBytecode* next = DYNAMIC_CAST(malBytecode, body); \
+        if (!next) { \
+            RETURN(EVAL(body, env)); \
+        } \
+        POP_TO(stack.data() + base); \
+        codeRef = body; \
+        bytecode = next; \
+        goto start; \
+    }
+
+    // Calls op with the n arguments on top of the stack, which start at
+    // args, going on at next, or at elseNext if that's set and the result
+    // is false. Bytecode is run by this loop, with a frame to come back to.
+    #define CALL(op, n, args, next, elseNext) { \
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op); \
+        if (!lambda && dispatch(op, sp - n, sp)) { \
+            lambda = DYNAMIC_CAST(malLambda, op); \
+        } \
+        malValuePtr body; \
+        if (lambda) { \
+            lambda = lambda->clause(n); \
+            body = lambdaBody(lambda); \
+        } \
+        const malBytecode* callee = body ? \
+            DYNAMIC_CAST(malBytecode, body) : NULL; \
+        if (!callee) { \
+            malValuePtr result = lambda ? \
+                body->eval(lambda->makeEnv(sp - n, sp)) : \
+                APPLY(op, sp - n, sp); \
+            POP_TO(args); \
+            if (elseNext) { \
+                pc = result->isTrue() ? next : elseNext; \
+            } \
+            else { \
+                *sp++ = result; \
+                pc = next; \
+            } \
+            goto dispatch; \
+        } \
+        MAL_CHECK(frames.size() < s_maxDepth, \
+                  "Stack overflow: calls nested more than %zu deep", \
+                  s_maxDepth); \
+        malCallFrame frame = { codeRef, next, elseNext, env, base, \
+                               envBase }; \
+        frames.push_back(frame); \
+        env = lambda->makeEnv(sp - n, sp); \
+        POP_TO(args); \
+        base = sp - stack.data(); \
+        envBase = outerEnvs.size(); \
+        codeRef = body; \
+        bytecode = callee; \
+        goto start; \
+    }
+
+    // Returns value from the code being run, to the frame that called it
+    // if there is one.
+    #define RETURN(value) { \
+        if (frames.empty()) { \
+            return value; \
+        } \
+        malValuePtr result = value; \
+        POP_TO(stack.data() + base); \
+        outerEnvs.resize(envBase); \
+        malCallFrame& frame = frames.back(); \
+        codeRef = frame.codeRef; \
+        bytecode = STATIC_CAST(malBytecode, codeRef); \
+        consts = bytecode->consts(); \
+        env = frame.env; \
+        base = frame.base; \
+        envBase = frame.envBase; \
+        if (frame.elsePc) { \
+            pc = result->isTrue() ? frame.pc : frame.elsePc; \
+        } \
+        else { \
+            *sp++ = result; \
+            pc = frame.pc; \
+        } \
+        frames.pop_back(); \
+        goto dispatch; \
+    }
+
+    static void* const labels[] = {
+        &&L_OP_CONST, &&L_OP_LOCAL, &&L_OP_LOCAL0, &&L_OP_GLOBAL, &&L_OP_POP,
+        &&L_OP_JUMP, &&L_OP_JUMP_IF_FALSE, &&L_OP_JUMP_IF_TRUE_OR_POP,
+        &&L_OP_JUMP_IF_FALSE_OR_POP, &&L_OP_CALL, &&L_OP_TAIL_CALL,
+        &&L_OP_CALL_GLOBAL, &&L_OP_TAIL_CALL_GLOBAL,
+        &&L_OP_CALL_GLOBAL_JUMP_IF_FALSE, &&L_OP_INT_OP,
+        &&L_OP_INT_OP_JUMP_IF_FALSE, &&L_OP_RETURN, &&L_OP_ENTER,
+        &&L_OP_SET_SLOT, &&L_OP_LEAVE, &&L_OP_CLOSURE, &&L_OP_CLAUSES,
+        &&L_OP_VECTOR, &&L_OP_HASH, &&L_OP_TEMPLATE, &&L_OP_EVAL, &&L_OP_TRY,
+        &&L_OP_TAIL_TRY, &&L_OP_THROW, &&L_OP_RECUR,
+    };
+    // A computed goto doesn't run destructors, so each instruction's locals
+    // are in a block that ends before it dispatches the next. From inside
+    // one, goto dispatch instead.
+    #define DISPATCH() goto *labels[*pc++]
+
+start:
+    // Entered again with bytecode set for each call it makes here.
+    pc = bytecode->code();
+    consts = bytecode->consts();
+    if ((int)stack.size() < base + bytecode->maxStack()) {
+        stack.resize(std::max(2 * stack.size(),
+                              (size_t)(base + bytecode->maxStack())));
+    }
+    sp = stack.data() + base;
+    outerEnvs.resize(envBase);
+dispatch:
+    DISPATCH();
+
+L_OP_CONST:
+    *sp++ = consts[pc[0]];
+    pc += 1;
+    DISPATCH();
+
+L_OP_LOCAL: {
+    malEnv* frame = env->frame(pc[0]);
+    malValuePtr value = frame->slot(pc[1]);
+    // A let* binding that isn't made yet, see malResolvedSymbol.
+    *sp++ = value ? value : frame->outer()->get(
+        STATIC_CAST(malSymbol, consts[pc[2]])->value());
+    pc += 3;
+}
+    DISPATCH();
+
+L_OP_LOCAL0: {
+    malValuePtr value = env->slot(pc[0]);
+    *sp++ = value ? value : env->outer()->get(
+        STATIC_CAST(malSymbol, consts[pc[1]])->value());
+    pc += 2;
+}
+    DISPATCH();
+
+L_OP_GLOBAL:
+    *sp++ = consts[pc[0]]->eval(env);
+    pc += 1;
+    DISPATCH();
+
+L_OP_POP:
+    *--sp = NULL;
+    DISPATCH();
+
+L_OP_JUMP:
+    pc = bytecode->code() + pc[0];
+    DISPATCH();
+
+L_OP_JUMP_IF_FALSE: {
+    bool isTrue = sp[-1]->isTrue();
+    *--sp = NULL;
+    pc = isTrue ? pc + 1 : bytecode->code() + pc[0];
+}
+    DISPATCH();
+
+L_OP_JUMP_IF_TRUE_OR_POP:
+    if (sp[-1]->isTrue()) {
+        pc = bytecode->code() + pc[0];
+    }
+    else {
+        *--sp = NULL;
+        pc++;
+    }
+    DISPATCH();
+
+L_OP_JUMP_IF_FALSE_OR_POP:
+    if (!sp[-1]->isTrue()) {
+        pc = bytecode->code() + pc[0];
+    }
+    else {
+        *--sp = NULL;
+        pc++;
+    }
+    DISPATCH();
+
+L_OP_CALL: {
+    int n = pc[0];
+    malValuePtr op = sp[-n - 1];
+    CALL(op, n, sp - n - 1, pc + 1, (const int*)NULL);
+}
+
+L_OP_TAIL_CALL: {
+    int n = pc[0];
+    malValuePtr op = sp[-n - 1];
+    TAIL_CALL(op, n);
+}
+
+L_OP_CALL_GLOBAL: {
+    int n = pc[1];
+    malValuePtr op = consts[pc[0]]->eval(env);
+    CALL(op, n, sp - n, pc + 2, (const int*)NULL);
+}
+
+L_OP_TAIL_CALL_GLOBAL: {
+    int n = pc[1];
+    malValuePtr op = consts[pc[0]]->eval(env);
+    TAIL_CALL(op, n);
+}
+
+L_OP_CALL_GLOBAL_JUMP_IF_FALSE: {
+    int n = pc[1];
+    malValuePtr op = consts[pc[0]]->eval(env);
+    CALL(op, n, sp - n, pc + 3, bytecode->code() + pc[2]);
+}
+
+L_OP_INT_OP: {
+    malValuePtr op = consts[pc[1]]->eval(env);
+    if ((op != consts[pc[1] + 1]) || !malIntOp::areIntegers(sp - 2)) {
+        CALL(op, 2, sp - 2, pc + 2, (const int*)NULL);
+    }
+    malValuePtr result = malIntOp::compute(
+        (malIntOp::Kind)pc[0],
+        STATIC_CAST(malInteger, sp[-2])->value(),
+        STATIC_CAST(malInteger, sp[-1])->value());
+    POP_TO(sp - 2);
+    *sp++ = result;
+    pc += 2;
+}
+    DISPATCH();
+
+L_OP_INT_OP_JUMP_IF_FALSE: {
+    malValuePtr op = consts[pc[1]]->eval(env);
+    if ((op != consts[pc[1] + 1]) || !malIntOp::areIntegers(sp - 2)) {
+        CALL(op, 2, sp - 2, pc + 3, bytecode->code() + pc[2]);
+    }
+    bool isTrue = malIntOp::compute(
+        (malIntOp::Kind)pc[0],
+        STATIC_CAST(malInteger, sp[-2])->value(),
+        STATIC_CAST(malInteger, sp[-1])->value())->isTrue();
+    POP_TO(sp - 2);
+    pc = isTrue ? pc + 3 : bytecode->code() + pc[2];
+}
+    DISPATCH();
+
+L_OP_RETURN:
+    RETURN(sp[-1]);
+
+L_OP_ENTER:
+    outerEnvs.push_back(env);
+    env = new malEnv(env, STATIC_CAST(malBinder, consts[pc[0]])->shape());
+    pc += 1;
+    DISPATCH();
+
+L_OP_SET_SLOT:
+    env->setSlot(pc[0], sp[-1]);
+    *--sp = NULL;
+    pc += 1;
+    DISPATCH();
+
+L_OP_LEAVE:
+    env = outerEnvs.back();
+    outerEnvs.pop_back();
+    DISPATCH();
+
+L_OP_CLOSURE: {
+    const malBinder* binder = STATIC_CAST(malBinder, consts[pc[0]]);
+    malValuePtr lambda = mal::lambda(binder->shape(), binder->sourceBody(),
+                                     env);
+    STATIC_CAST(malLambda, lambda)->setResolvedBody(consts[pc[0] + 1],
+                                                    binder->epoch());
+    *sp++ = lambda;
+    pc += 1;
+}
+    DISPATCH();
+
+L_OP_CLAUSES: {
+    int n = pc[0];
+    pc += 1;
+    malValueVec clauses(sp - n, sp);
+    malValuePtr lambda = mal::lambda(clauses);
+    POP_TO(sp - n);
+    *sp++ = lambda;
+}
+    DISPATCH();
+
+L_OP_VECTOR: {
+    int n = pc[0];
+    pc += 1;
+    malValuePtr vec = mal::vector(sp - n, sp);
+    POP_TO(sp - n);
+    *sp++ = vec;
+}
+    DISPATCH();
+
+L_OP_HASH: {
+    int n = pc[0];
+    pc += 1;
+    malValuePtr hash = mal::hash(sp - 2 * n, sp, true);
+    POP_TO(sp - 2 * n);
+    *sp++ = hash;
+}
+    DISPATCH();
+
+L_OP_TEMPLATE: {
+    const malTemplate* tmpl = STATIC_CAST(malTemplate, consts[pc[0]]);
+    int n = pc[1];
+    pc += 2;
+    malValuePtr form = tmpl->instantiate(sp - n);
+    POP_TO(sp - n);
+    *sp++ = form;
+}
+    DISPATCH();
+
+L_OP_EVAL:
+    *sp++ = EVAL(consts[pc[0]], env);
+    pc += 1;
+    DISPATCH();
+
+L_OP_TRY:
+L_OP_TAIL_TRY: {
+    bool isTail = pc[-1] == OP_TAIL_TRY;
+    const malValuePtr* k = consts + pc[0];
+    pc += 1;
+    malValuePtr excVal;
+    try {
+        malValuePtr value = STATIC_CAST(malBytecode, k[0])->run(env);
+        if (isThrown(value)) {
+            excVal = takeThrown();
+        }
+        else {
+            *sp++ = value;
+        }
+    }
+    catch(String& s) {
+        excVal = mal::string(s);
+    }
+    catch (malEmptyInputException&) {
+        *sp++ = mal::nilValue();
+    }
+    catch(malValuePtr& o) {
+        excVal = o;
+    };
+    if (excVal) {
+        malEnvPtr inner(new malEnv(env,
+            STATIC_CAST(malBinder, k[1])->shape(), &excVal, &excVal + 1));
+        if (isTail) {
+            POP_TO(stack.data() + base);
+            env = inner;
+            codeRef = k[2];
+            bytecode = STATIC_CAST(malBytecode, codeRef);
+            goto start;
+        }
+        malValuePtr value = STATIC_CAST(malBytecode, k[2])->run(inner);
+        if (isThrown(value)) {
+            return value;
+        }
+        *sp++ = value;
+    }
+    if (isTail) {
+        RETURN(sp[-1]);
+    }
+}
+    DISPATCH();
+
+L_OP_THROW: {
+    // The throw goes straight back to the try* whose run called this one.
+    malValuePtr op = consts[pc[0]]->eval(env);
+    if (op != consts[pc[0] + 1]) {
+        CALL(op, 1, sp - 1, pc + 1, (const int*)NULL);
+    }
+    return throwValue(sp[-1]);
+}
+
+L_OP_RECUR: {
+    // Back to the loop's frame, which is bound again in place unless a
+    // closure has kept it.
+    int depth = pc[0];
+    int n = pc[1];
+    if (depth > 0) {
+        env = outerEnvs[outerEnvs.size() - depth];
+        outerEnvs.resize(outerEnvs.size() - depth);
+    }
+    if (env->refCount() != 1) {
+        env = env->emptyCopy();
+    }
+    const malEnvShape* shape = env->shape();
+    for (int i = 0; i < n; i++) {
+        env->setSlot(shape->bindingSlot(i), sp[i - n]);
+    }
+    POP_TO(sp - n);
+    pc = bytecode->code() + pc[2];
+}
+    DISPATCH();
+
+    #undef DISPATCH
+    #undef RETURN
+    #undef CALL
+    #undef TAIL_CALL
+    #undef POP_TO
+}
+
+bool isBytecode(malValuePtr value)
+{
+    return DYNAMIC_CAST(malBytecode, value) != NULL;
+}
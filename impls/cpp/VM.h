@@ -0,0 +1,11 @@
+#ifndef INCLUDE_VM_H
+#define INCLUDE_VM_H
+
+#include "MAL.h"
+
+// Compiles resolved code to bytecode, returning the body for a lambda to
+// run, see malBytecode.
+extern malValuePtr compileBytecode(malValuePtr ast);
+extern bool isBytecode(malValuePtr value);
+
+#endif // INCLUDE_VM_H
@@ -58,16 +58,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     // From here on down we are evaluating a non-empty list.
     // First handle the special forms.
     if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-        String special = symbol->value();
         int argCount = list->count() - 1;
 
-        if (special == "def!") {
+        switch (symbol->specialForm()) {
+        case malSymbol::Def: {
             checkArgsIs("def!", 2, argCount);
             const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
             return env->set(id->value(), EVAL(list->item(2), env));
         }
 
-        if (special == "let*") {
+        case malSymbol::Let: {
             checkArgsIs("let*", 2, argCount);
             const malSequence* bindings =
                 VALUE_CAST(malSequence, list->item(1));
@@ -80,12 +80,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             }
             return EVAL(list->item(2), inner);
         }
+
+        default:
+            break;
+        }
     }
 
     // Now we're left with the case of a regular list to be evaluated.
     std::unique_ptr<malValueVec> items(list->evalItems(env));
     malValuePtr op = items->at(0);
-    return APPLY(op, items->begin()+1, items->end());
+    return APPLY(op, items->data()+1, items->data()+items->size());
 }
 
 String PRINT(malValuePtr ast)
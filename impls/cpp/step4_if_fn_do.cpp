@@ -60,16 +60,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     // From here on down we are evaluating a non-empty list.
     // First handle the special forms.
     if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-        String special = symbol->value();
         int argCount = list->count() - 1;
 
-        if (special == "def!") {
+        switch (symbol->specialForm()) {
+        case malSymbol::Def: {
             checkArgsIs("def!", 2, argCount);
             const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
             return env->set(id->value(), EVAL(list->item(2), env));
         }
 
-        if (special == "do") {
+        case malSymbol::Do: {
             checkArgsAtLeast("do", 1, argCount);
 
             for (int i = 1; i < argCount; i++) {
@@ -78,7 +78,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             return EVAL(list->item(argCount), env);
         }
 
-        if (special == "fn*") {
+        case malSymbol::Fn: {
             checkArgsIs("fn*", 2, argCount);
 
             const malSequence* bindings =
@@ -93,7 +93,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             return mal::lambda(params, list->item(2), env);
         }
 
-        if (special == "if") {
+        case malSymbol::If: {
             checkArgsBetween("if", 2, 3, argCount);
 
             bool isTrue = EVAL(list->item(1), env)->isTrue();
@@ -103,7 +103,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             return EVAL(list->item(isTrue ? 2 : 3), env);
         }
 
-        if (special == "let*") {
+        case malSymbol::Let: {
             checkArgsIs("let*", 2, argCount);
             const malSequence* bindings =
                 VALUE_CAST(malSequence, list->item(1));
@@ -116,6 +116,10 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             }
             return EVAL(list->item(2), inner);
         }
+
+        default:
+            break;
+        }
     }
 
     // Now we're left with the case of a regular list to be evaluated.
@@ -123,10 +127,10 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     malValuePtr op = items->at(0);
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
         return EVAL(lambda->getBody(),
-                    lambda->makeEnv(items->begin()+1, items->end()));
+                    lambda->makeEnv(items->data()+1, items->data()+items->size()));
     }
     else {
-        return APPLY(op, items->begin()+1, items->end());
+        return APPLY(op, items->data()+1, items->data()+items->size());
     }
 }
 
@@ -96,16 +96,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
+            switch (symbol->specialForm()) {
+            case malSymbol::Def: {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 return env->set(id->value(), EVAL(list->item(2), env));
             }
 
-            if (special == "defmacro!") {
+            case malSymbol::DefMacro: {
                 checkArgsIs("defmacro!", 2, argCount);
 
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
@@ -114,7 +114,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 return env->set(id->value(), mal::macro(*lambda));
             }
 
-            if (special == "do") {
+            case malSymbol::Do: {
                 checkArgsAtLeast("do", 1, argCount);
 
                 for (int i = 1; i < argCount; i++) {
@@ -124,7 +124,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "fn*") {
+            case malSymbol::Fn: {
                 checkArgsIs("fn*", 2, argCount);
 
                 const malSequence* bindings =
@@ -139,7 +139,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 return mal::lambda(params, list->item(2), env);
             }
 
-            if (special == "if") {
+            case malSymbol::If: {
                 checkArgsBetween("if", 2, 3, argCount);
 
                 bool isTrue = EVAL(list->item(1), env)->isTrue();
@@ -150,7 +150,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "let*") {
+            case malSymbol::Let: {
                 checkArgsIs("let*", 2, argCount);
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
@@ -166,28 +166,28 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "macroexpand") {
+            case malSymbol::MacroExpand: {
                 checkArgsIs("macroexpand", 1, argCount);
                 return macroExpand(list->item(1), env);
             }
 
-            if (special == "quasiquoteexpand") {
+            case malSymbol::QuasiquoteExpand: {
                 checkArgsIs("quasiquote", 1, argCount);
                 return quasiquote(list->item(1));
             }
 
-            if (special == "quasiquote") {
+            case malSymbol::Quasiquote: {
                 checkArgsIs("quasiquote", 1, argCount);
                 ast = quasiquote(list->item(1));
                 continue; // TCO
             }
 
-            if (special == "quote") {
+            case malSymbol::Quote: {
                 checkArgsIs("quote", 1, argCount);
                 return list->item(1);
             }
 
-            if (special == "try*") {
+            case malSymbol::Try: {
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
@@ -232,6 +232,10 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 }
                 continue; // TCO
             }
+
+            default:
+                break;
+            }
         }
 
         // Now we're left with the case of a regular list to be evaluated.
@@ -239,11 +243,11 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         malValuePtr op = items->at(0);
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            env = lambda->makeEnv(items->data()+1, items->data()+items->size());
             continue; // TCO
         }
         else {
-            return APPLY(op, items->begin()+1, items->end());
+            return APPLY(op, items->data()+1, items->data()+items->size());
         }
     }
 }
@@ -1,7 +1,10 @@
 #include "MAL.h"
 
+#include "Emitter.h"
 #include "Environment.h"
 #include "ReadLine.h"
+#include "Resolver.h"
+#include "Runtime.h"
 #include "Types.h"
 
 #include <iostream>
@@ -14,19 +17,28 @@ static void installFunctions(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+static int runCompiledProgram(int argc, char* argv[]);
 
 static ReadLine s_readLine("~/.mal-history");
 
-static malEnvPtr replEnv(new malEnv);
-
 int main(int argc, char* argv[])
 {
+    if (s_compiledProgram) {
+        return runCompiledProgram(argc, argv);
+    }
     String prompt = "user> ";
     String input;
+    if ((argc > 1) && (String(argv[1]) == "--vm")) {
+        s_useVM = true;
+        argc--;
+        argv++;
+    }
+    configure(&argc);
     installCore(replEnv);
     installFunctions(replEnv);
+    if ((argc > 2) && (String(argv[1]) == "--emit-cpp")) {
+        return emitCpp(argv[2]);
+    }
     makeArgv(replEnv, argc - 2, argv + 2);
     if (argc > 1) {
         String filename = escape(argv[1]);
@@ -79,9 +91,13 @@ malValuePtr READ(const String& input)
 
 malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 {
+    checkStack();
     if (!env) {
         env = replEnv;
     }
+    // The loop* this is the tail of, if any, for a recur to go back to.
+    malValuePtr loopForm;
+    malEnvPtr loopEnv;
     while (1) {
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
@@ -97,25 +113,77 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
+            malSymbol::SpecialForm special = symbol->specialForm();
+            if (isLibraryForm(special)) {
+                malEnvPtr symEnv = env->find(symbol->value());
+                if (symEnv && !isPreludeCond(symbol,
+                                   symEnv->getOwn(symbol->value()).ptr())) {
+                    special = malSymbol::NotSpecial;
+                }
+            }
+            switch (special) {
+            case malSymbol::Def: {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                malValuePtr value = EVAL(list->item(2), env);
+                malEnvPtr idEnv = env->find(id->value());
+                malValuePtr old;
+                if (idEnv) {
+                    old = idEnv->getOwn(id->value());
+                }
+                const malBuiltIn* builtin =
+                    old ? DYNAMIC_CAST(malBuiltIn, old) : NULL;
+                const malLambda* lambda =
+                    old ? DYNAMIC_CAST(malLambda, old) : NULL;
+                if (isMacro(value) || isMacro(old) ||
+                    (builtin && builtin->isPure()) ||
+                    (lambda && lambda->isInlined()) ||
+                    isLibraryForm(id->specialForm())) {
+                    // Resolved code may have expanded the old macro, folded
+                    // calls of the old builtin, inlined the old lambda, or
+                    // taken a name this hides for the special form.
+                    malEnv::invalidateResolved();
+                }
+                return env->set(id->value(), value);
             }
 
-            if (special == "defmacro!") {
+            case malSymbol::DefMacro: {
                 checkArgsIs("defmacro!", 2, argCount);
 
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 malValuePtr body = EVAL(list->item(2), env);
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+                malValuePtr macro = mal::macro(*lambda);
+                env->set(id->value(), macro);
+                malEnv::invalidateResolved();
+                return macro;
+            }
+
+            case malSymbol::DefProtocol: {
+                checkArgsAtLeast("defprotocol", 1, argCount);
+                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+                StringVec names;
+                for (int i = 2; i <= argCount; i++) {
+                    const malSequence* method =
+                        VALUE_CAST(malSequence, list->item(i));
+                    checkArgsIs("defprotocol method", 2, method->count());
+                    names.push_back(
+                        VALUE_CAST(malSymbol, method->item(0))->value());
+                }
+                malValuePtr protocol = mal::protocol(id->value(), names);
+                const malProtocol* methods =
+                    STATIC_CAST(malProtocol, protocol);
+                for (int i = 0; i < methods->methodCount(); i++) {
+                    env->set(names[i], methods->method(i));
+                }
+                // As for def!, resolved code may have used the old values.
+                malEnv::invalidateResolved();
+                return env->set(id->value(), protocol);
             }
 
-            if (special == "do") {
+            case malSymbol::Do: {
                 checkArgsAtLeast("do", 1, argCount);
 
                 for (int i = 1; i < argCount; i++) {
@@ -125,22 +193,22 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
-
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+            case malSymbol::Fn: {
+                if (!hasClauses(list)) {
+                    checkArgsIs("fn*", 2, argCount);
+                    return makeLambda(list->item(1), list->item(2), env);
                 }
-
-                return mal::lambda(params, list->item(2), env);
+                malValueVec clauses;
+                for (int i = 1; i <= argCount; i++) {
+                    const malList* clause = VALUE_CAST(malList, list->item(i));
+                    checkArgsIs("fn* clause", 2, clause->count());
+                    clauses.push_back(makeLambda(clause->item(0),
+                                                 clause->item(1), env));
+                }
+                return mal::lambda(clauses);
             }
 
-            if (special == "if") {
+            case malSymbol::If: {
                 checkArgsBetween("if", 2, 3, argCount);
 
                 bool isTrue = EVAL(list->item(1), env)->isTrue();
@@ -151,48 +219,150 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "let*") {
+            case malSymbol::And:
+            case malSymbol::Or: {
+                // The first item that decides the result is the result, or
+                // else the last item is.
+                bool isAnd = symbol->specialForm() == malSymbol::And;
+                if (argCount == 0) {
+                    return isAnd ? mal::trueValue() : mal::nilValue();
+                }
+                for (int i = 1; i < argCount; i++) {
+                    malValuePtr value = EVAL(list->item(i), env);
+                    if (value->isTrue() != isAnd) {
+                        return value;
+                    }
+                }
+                ast = list->item(argCount);
+                continue; // TCO
+            }
+
+            case malSymbol::Cond: {
+                int i = 1;
+                while ((i < argCount) &&
+                       !EVAL(list->item(i), env)->isTrue()) {
+                    i += 2;
+                }
+                MAL_CHECK(i != argCount, "odd number of forms to cond");
+                if (i > argCount) {
+                    return mal::nilValue();
+                }
+                ast = list->item(i + 1);
+                continue; // TCO
+            }
+
+            case malSymbol::Let: {
                 checkArgsIs("let*", 2, argCount);
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
                 int count = checkArgsEven("let*", bindings->count());
+
+                malValuePtr resolved = resolveForm(ast, env);
+                if (resolved != ast) {
+                    return compileForm(resolved, env);
+                }
+
+                malEnvPtr inner(new malEnv(env));
+                for (int i = 0; i < count; i += 2) {
+                    const malSymbol* var =
+                        VALUE_CAST(malSymbol, bindings->item(i));
+                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                }
+                ast = list->item(2);
+                env = inner;
+                continue; // TCO
+            }
+
+            case malSymbol::Loop: {
+                checkArgsIs("loop*", 2, argCount);
+                const malSequence* bindings =
+                    VALUE_CAST(malSequence, list->item(1));
+                int count = checkArgsEven("loop*", bindings->count());
+
+                malValuePtr resolved = resolveForm(ast, env);
+                if (resolved != ast) {
+                    return compileForm(resolved, env);
+                }
+
                 malEnvPtr inner(new malEnv(env));
                 for (int i = 0; i < count; i += 2) {
                     const malSymbol* var =
                         VALUE_CAST(malSymbol, bindings->item(i));
                     inner->set(var->value(), EVAL(bindings->item(i+1), inner));
                 }
+                loopForm = ast;
+                loopEnv = env;
                 ast = list->item(2);
                 env = inner;
                 continue; // TCO
             }
 
-            if (special == "macroexpand") {
+            case malSymbol::Recur: {
+                MAL_CHECK(loopForm, "recur must be in tail position of loop*");
+                const malList* loop = STATIC_CAST(malList, loopForm);
+                const malSequence* bindings =
+                    STATIC_CAST(malSequence, loop->item(1));
+                checkArgsIs("recur", bindings->count() / 2, argCount);
+                malSmallVec args(argCount);
+                for (int i = 0; i < argCount; i++) {
+                    args[i] = EVAL(list->item(i + 1), env);
+                }
+                env = new malEnv(loopEnv);
+                for (int i = 0; i < argCount; i++) {
+                    const malSymbol* var =
+                        STATIC_CAST(malSymbol, bindings->item(2 * i));
+                    env->set(var->value(), args[i]);
+                }
+                ast = loop->item(2);
+                continue; // TCO
+            }
+
+            case malSymbol::MacroExpand: {
                 checkArgsIs("macroexpand", 1, argCount);
                 return macroExpand(list->item(1), env);
             }
 
-            if (special == "quasiquoteexpand") {
+            case malSymbol::QuasiquoteExpand: {
                 checkArgsIs("quasiquote", 1, argCount);
                 return quasiquote(list->item(1));
             }
 
-            if (special == "quasiquote") {
+            case malSymbol::Quasiquote: {
                 checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
+                // The expansion depends on nothing but the form.
+                malValuePtr expansion = list->expansion(symbol);
+                if (!expansion) {
+                    expansion = quasiquote(list->item(1));
+                    list->setExpansion(symbol, expansion);
+                }
+                ast = expansion;
                 continue; // TCO
             }
 
-            if (special == "quote") {
+            case malSymbol::ThreadFirst:
+            case malSymbol::ThreadLast: {
+                checkArgsAtLeast(symbol->value().c_str(), 1, argCount);
+                malValuePtr expansion = list->expansion(symbol);
+                if (!expansion) {
+                    expansion = threadForm(list, symbol->specialForm() ==
+                                                 malSymbol::ThreadLast);
+                    list->setExpansion(symbol, expansion);
+                }
+                ast = expansion;
+                continue; // TCO
+            }
+
+            case malSymbol::Quote: {
                 checkArgsIs("quote", 1, argCount);
                 return list->item(1);
             }
 
-            if (special == "try*") {
+            case malSymbol::Try: {
                 malValuePtr tryBody = list->item(1);
 
+                loopForm = NULL;
                 if (argCount == 1) {
-                    ast = EVAL(tryBody, env);
+                    ast = tryBody;
                     continue; // TCO
                 }
                 checkArgsIs("try*", 2, argCount);
@@ -212,14 +382,14 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 malValuePtr excVal;
 
                 try {
-                    ast = EVAL(tryBody, env);
+                    return EVAL(tryBody, env);
                 }
                 catch(String& s) {
                     excVal = mal::string(s);
                 }
                 catch (malEmptyInputException&) {
                     // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
+                    return mal::nilValue();
                 }
                 catch(malValuePtr& o) {
                     excVal = o;
@@ -233,18 +403,28 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 }
                 continue; // TCO
             }
+
+            default:
+                break;
+            }
         }
 
         // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
+        malValuePtr op = EVAL(list->item(0), env);
+        malSmallVec args(list->count() - 1);
+        for (int i = 0; i < args.size(); i++) {
+            args[i] = EVAL(list->item(i + 1), env);
+        }
+        dispatch(op, args.begin(), args.end());
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            lambda = lambda->clause(args.size());
+            ast = lambdaBody(lambda);
+            lambda->rebindEnv(env, args.begin(), args.end());
+            loopForm = NULL;
             continue; // TCO
         }
         else {
-            return APPLY(op, items->begin()+1, items->end());
+            return APPLY(op, args.begin(), args.end());
         }
     }
 }
@@ -263,72 +443,25 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
-{
-    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
-}
-
-//  Return arg when ast matches ('sym, arg), else NULL.
-static malValuePtr starts_with(const malValuePtr ast, const char* sym)
+//  Runs a program made by --emit-cpp, in the environment the interpreter
+//  would run its source in.
+static int runCompiledProgram(int argc, char* argv[])
 {
-    const malList* list = DYNAMIC_CAST(malList, ast);
-    if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
-        return NULL;
-    checkArgsIs(sym, 1, list->count() - 1);
-    return list->item(1);
-}
-
-static malValuePtr quasiquote(malValuePtr obj)
-{
-    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
-        return mal::list(mal::symbol("quote"), obj);
-
-    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
-    if (!seq)
-        return obj;
-
-    const malValuePtr unquoted = starts_with(obj, "unquote");
-    if (unquoted)
-        return unquoted;
-
-    malValuePtr res = mal::list(new malValueVec(0));
-    for (int i=seq->count()-1; 0<=i; i--) {
-        const malValuePtr elt     = seq->item(i);
-        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
-        if (spl_unq)
-            res = mal::list(mal::symbol("concat"), spl_unq, res);
-         else
-            res = mal::list(mal::symbol("cons"), quasiquote(elt), res);
+    configure(&argc);
+    installCore(replEnv);
+    installFunctions(replEnv);
+    makeArgv(replEnv, argc - 1, argv + 1);
+    try {
+        s_compiledProgram(replEnv);
+        return 0;
     }
-    if (DYNAMIC_CAST(malVector, obj))
-        res = mal::list(mal::symbol("vec"), res);
-    return res;
-}
-
-static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
-{
-    const malList* seq = DYNAMIC_CAST(malList, obj);
-    if (seq && !seq->isEmpty()) {
-        if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
-            }
-        }
+    catch (malValuePtr& mv) {
+        std::cerr << "Error: " << mv->print(true) << "\n";
     }
-    return NULL;
-}
-
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
-{
-    while (const malLambda* macro = isMacroApplication(obj, env)) {
-        const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end());
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
     }
-    return obj;
+    return 1;
 }
 
 static const char* malFunctionTable[] = {
@@ -337,12 +470,17 @@ static const char* malFunctionTable[] = {
     "(def! load-file (fn* (filename) \
         (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
     "(def! *host-language* \"C++\")",
+    "(defmacro! defmulti (fn* [name dispatch] \
+        `(def! ~name (multimethod ~(str name) ~dispatch))))",
+    "(defmacro! defmethod (fn* [name value params & body] \
+        `(add-method ~name ~value (fn* ~params (do ~@body)))))",
 };
 
 static void installFunctions(malEnvPtr env) {
     for (auto &function : malFunctionTable) {
         rep(function, env);
     }
+    s_condMacro = env->get("cond");
 }
 
 // Added to keep the linker happy at step A